@@ -0,0 +1,180 @@
+#!/usr/bin/env python3
+
+import argparse
+import json
+import os
+import random
+import re
+import shlex
+import shutil
+import subprocess
+import sys
+
+parser = argparse.ArgumentParser(
+    description="""
+Benchmark duplines on a synthetic source corpus
+
+Generates a reproducible corpus (reused while the generator options are
+unchanged), then runs duplines --stats over it for each -m/-M range and prints
+the time of each phase, throughput, and peak memory use.
+
+Example:
+    duplines-bench.py bin/duplines --size 50M --ranges 3:8,10:40
+    duplines-bench.py bin/duplines --args=--engine=suffix
+""",
+    formatter_class=argparse.RawTextHelpFormatter,
+)
+parser.add_argument("binary", help="path to duplines")
+parser.add_argument("--corpus", default="bin/bench-corpus", help="corpus directory")
+parser.add_argument("--size", default="20M", help="corpus size in bytes")
+parser.add_argument("--files", type=int, default=200, help="number of files")
+parser.add_argument(
+    "--line-length", type=int, default=40, help="mean line length in bytes"
+)
+parser.add_argument(
+    "--dup-rate",
+    type=float,
+    default=0.1,
+    help="fraction of lines in planted duplicate blocks",
+)
+parser.add_argument("--seed", type=int, default=1)
+parser.add_argument(
+    "--ranges",
+    default="3:8,5:20,10:50",
+    help="comma-separated MIN:MAX ranges to run",
+)
+parser.add_argument(
+    "--repeat", type=int, default=3, help="runs per range (the best is kept)"
+)
+parser.add_argument("--args", default="", help="extra duplines arguments")
+args = parser.parse_args()
+
+WORDS = """
+    auto bool break buffer case char const continue count data default else
+    end error file first for if index input int key last len line map next
+    node offset out pos result return size start static struct switch value
+    vector while
+""".split()
+PUNCT = ["(", ")", ";", ",", " = ", " + ", " < ", "->", ".", "{", "}", "[", "]"]
+
+
+def parse_size(text):
+    match = re.fullmatch(r"(\d+)([KMG]?)", text)
+    if not match:
+        sys.exit(f"invalid size: {text}")
+    return int(match[1]) << {"": 0, "K": 10, "M": 20, "G": 30}[match[2]]
+
+
+def make_line(rng, mean):
+    if rng.random() < 0.1:
+        return ""
+    # Line lengths are roughly log-normal, like real source code.
+    target = max(1, int(rng.lognormvariate(0, 0.5) * mean))
+    parts = ["    " * rng.randrange(4)]
+    length = len(parts[0])
+    while length < target:
+        part = rng.choice(WORDS) if rng.random() < 0.6 else rng.choice(PUNCT)
+        if rng.random() < 0.2:
+            part += str(rng.randrange(1000))
+        parts.append(part)
+        length += len(part)
+    return "".join(parts)
+
+
+def generate(params):
+    rng = random.Random(params["seed"])
+    total = parse_size(params["size"])
+    per_file = total // params["files"]
+    mean = params["line_length"]
+    blocks = []
+    for i in range(params["files"]):
+        lines = []
+        size = 0
+        while size < per_file:
+            if blocks and rng.random() < params["dup_rate"] / 10:
+                # Blocks average about 10 lines, so this plants roughly the
+                # given rate.
+                block = rng.choice(blocks)
+            else:
+                block = [make_line(rng, mean)]
+                if rng.random() < 0.02:
+                    count = rng.randrange(3, 18)
+                    block += [make_line(rng, mean) for _ in range(count)]
+                    blocks.append(block)
+            lines += block
+            size += sum(len(line) + 1 for line in block)
+        with open(os.path.join(args.corpus, f"f{i:05}.txt"), "w") as f:
+            f.write("\n".join(lines) + "\n")
+
+
+def ensure_corpus():
+    params = {
+        "size": args.size,
+        "files": args.files,
+        "line_length": args.line_length,
+        "dup_rate": args.dup_rate,
+        "seed": args.seed,
+    }
+    manifest = os.path.join(args.corpus, "params.json")
+    try:
+        with open(manifest) as f:
+            if json.load(f) == params:
+                return
+    except FileNotFoundError:
+        pass
+    print(f"generating corpus in {args.corpus}", file=sys.stderr)
+    shutil.rmtree(args.corpus, ignore_errors=True)
+    os.makedirs(args.corpus)
+    generate(params)
+    with open(manifest, "w") as f:
+        json.dump(params, f)
+
+
+def run(lo, hi):
+    files = sorted(
+        os.path.join(args.corpus, name)
+        for name in os.listdir(args.corpus)
+        if name.endswith(".txt")
+    )
+    cmd = [args.binary, "--stats", "-m", lo, "-M", hi] + shlex.split(args.args) + files
+    result = subprocess.run(
+        cmd, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, text=True
+    )
+    if result.returncode != 0:
+        sys.exit(result.stderr)
+    phases = {}
+    stats = {}
+    for line in result.stderr.splitlines():
+        # Phases, and the total, are followed by their CPU time, which is
+        # ignored. A phase may be reported more than once.
+        match = re.match(r"(.+?)\s+([\d.]+) s\s+[\d.]+ s cpu$", line)
+        if match:
+            phases[match[1]] = phases.get(match[1], 0) + float(match[2])
+            continue
+        match = re.match(r"(.+?)\s+([\d.]+)( MiB)?(\s|$)", line)
+        if match:
+            stats[match[1]] = float(match[2])
+    stats["total"] = phases.pop("total")
+    stats["phases"] = phases
+    return stats
+
+
+ensure_corpus()
+results = []
+for spec in args.ranges.split(","):
+    lo, hi = spec.split(":")
+    runs = [run(lo, hi) for _ in range(args.repeat)]
+    results.append((spec, min(runs, key=lambda stats: stats["total"])))
+# Every phase reported by any run, in the order reported, since the engines
+# and modes have different phases.
+phases = list(dict.fromkeys(name for _, best in results for name in best["phases"]))
+columns = phases + ["total", "lines/s", "peak rss"]
+print(f"{'range':<10}" + "".join(f"{c:>12}" for c in columns))
+for spec, best in results:
+    cells = [
+        f"{best['phases'][c]:.3f}" if c in best["phases"] else "-" for c in phases
+    ]
+    cells.append(f"{best['total']:.3f}")
+    cells.append(f"{best['lines/s']:.0f}")
+    cells.append(f"{best['peak rss']:.1f}M")
+    print(f"{spec:<10}" + "".join(f"{c:>12}" for c in cells))
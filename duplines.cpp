@@ -1,161 +1,5810 @@
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdarg>
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <filesystem>
-#include <fstream>
 #include <functional>
-#include <set>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <tuple>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+extern "C" {
+#include <dirent.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+}
+
+extern char** environ;
+
 namespace {
 
 // =============================================================================
-//       Command-line interface
+//       Command-line interface
+// =============================================================================
+
+const char* const USAGE = R"EOS(
+Usage: duplines [-hrlbin] [-m MIN] [-M MAX] [-j JOBS] [-k TOP]
+                [--engine=ENGINE] [--memory-limit=SIZE] [--cache=FILE]
+                [--exclude=GLOB] [--format=FORMAT] [--max-edits=N] [--stats]
+                [--progressive] [--build-index=INDEX | --serve=SOCKET] FILE ...
+       duplines [OPTIONS] --rev=REV ... [PATH ...]
+       duplines --query=INDEX [-n] [--format=FORMAT] [DIFF | FILE:LINES ...]
+
+This script finds duplicate regions in text files.
+
+A FILE of - means standard input, which is always read as a stream. If any
+FILE is a pipe or other stream, all files are read once, in order, keeping only
+the last MAX lines and the fingerprints of recent windows of MIN lines. Each
+duplicate is then printed as soon as it ends, paired with the first copy.
+
+Files compressed with gzip or zstd, detected by their first bytes, are
+decompressed by running the gzip or zstd command, which must be installed.
+
+Flags:
+    -h  display this help messge
+    -r  search directories recursively, skipping binary files and paths
+        ignored by .gitignore files
+    -l  ignore leading whitespace
+    -b  ignore changes in the amount of whitespace, including trailing
+    -i  ignore case (ASCII only)
+    -n  print only the locations of duplicates, not their lines
+    -m  minimum number of lines in region
+    -M  maximum number of lines in region (hash and sort engines only)
+    -j  number of threads to use (default: number of CPUs)
+    -k  report only the TOP largest sets of duplicates; the hash engine then
+        indexes one region length at a time, from MAX down, and stops early;
+        this bounds memory by the regions of one length, but if there are
+        fewer than TOP large duplicates it reads every line once per length
+        and is slower than without -k
+
+Options:
+    --engine=hash    index every region of MIN to MAX lines (default)
+    --engine=sort    find the same regions as the hash engine by radix
+                     sorting one flat array of every region, which uses
+                     more predictable memory than hash tables
+    --engine=suffix  find maximal regions of at least MIN lines, with no
+                     upper bound, using a suffix array over the lines
+    --engine=seed    find the same regions as the suffix engine by indexing
+                     only regions of MIN lines, and extending those that
+                     occur more than once line by line
+    --engine=near    find regions of at least MIN lines that differ by at
+                     most N changed, inserted, or deleted lines in every
+                     MIN lines, on average, using MinHash signatures of
+                     each window of MIN lines; each set lists every copy of
+                     a region once, with the most edits between two copies
+                     that were matched
+
+    --max-edits=N  line edits allowed by the near engine per MIN lines, so a
+                   region of 3*MIN lines may differ by 3*N (default: 1)
+
+    --stats  print to stderr the wall and CPU time of each phase, throughput,
+             windows indexed of each length, hash table load and probes,
+             fingerprint collisions, sets printed and suppressed as overlapping
+             ones already printed, and peak memory use
+
+    --progressive  print pairs of duplicates as soon as both copies are read,
+                   then the full report, skipping sets already printed;
+                   the early pairs are provisional, since sets in the full
+                   report may then overlap them, extending them or adding
+                   copies (hash engine only)
+
+    --memory-limit=SIZE  keep memory use to about SIZE bytes (e.g. 512M) by
+                         sorting windows in temporary files in $TMPDIR, for
+                         inputs larger than memory (hash engine only); when
+                         reading a stream, limit the fingerprints kept
+                         instead (default: 64M)
+
+    --cache=FILE  remember the lines and line hashes of each file in FILE,
+                  and reuse them for files whose size, modification time,
+                  and inode have not changed since the last run
+
+    --build-index=INDEX  instead of reporting duplicates, write an index of
+                         every region of MIN lines to INDEX
+    --query=INDEX        report duplicates of changed lines found in INDEX or
+                         elsewhere in the same file, taking the lines added
+                         by each unified DIFF (standard input by default) or
+                         given as FILE:LINE or FILE:START-END; MIN and the
+                         flags -l, -b, and -i come from INDEX
+
+    --serve=SOCKET  keep every region of MIN lines in memory, and answer
+                    requests on the Unix domain socket SOCKET, one per line:
+                        update FILE        reread FILE, or forget it if deleted
+                        query FILE:LINES   report duplicates of those lines
+                        block N            report duplicates of the N lines
+                                           that follow
+                    each answered by any duplicates, then "ok" or "error: "
+                    and a message; clients are served one at a time, and
+                    one idle for 10 seconds is disconnected; an existing
+                    file at SOCKET is replaced only if it is a socket
+
+    --rev=REV  search the files in git revision REV of the repository in the
+               current directory, limited to PATHs if given, instead of FILEs;
+               may be repeated, and a file that is the same in several
+               revisions or paths is searched once, located as REV:PATH
+
+    --exclude=GLOB  with -r, skip paths matching GLOB, which uses the syntax
+                    of .gitignore and is relative to each directory searched,
+                    even if a .gitignore file re-includes them; may be
+                    repeated
+
+    --format=text   print locations, then the lines quoted with "> " (default)
+    --format=jsonl  print each set of duplicates as a JSON object on one line,
+                    with keys "length", "locations" (objects with "file" and
+                    "line"), and "lines" (omitted with -n)
+)EOS";
+
+enum class Engine {
+    Hash,
+    Sort,
+    Suffix,
+    Seed,
+    Near,
+};
+
+enum class Format {
+    Text,
+    Jsonl,
+};
+
+struct Options {
+    int min = 0;
+    int max = 0;
+    int jobs = 0;
+    // Number of sets of duplicates to report, or 0 for all of them.
+    int top = 0;
+    Engine engine = Engine::Hash;
+    // Line edits allowed between near duplicates.
+    int max_edits = 1;
+    Format format = Format::Text;
+    // Whether to print the duplicated lines along with their locations.
+    bool snippet = true;
+    std::size_t memory_limit = 0;
+    const char* cache = nullptr;
+    bool stats = false;
+    // Whether to print pairs of duplicates while still reading inputs.
+    bool progressive = false;
+    // Whether any input is a pipe or other stream, which find_dups_stream
+    // reads once, in order, instead of mapping.
+    bool stream = false;
+    // Index to write instead of reporting duplicates, or to query.
+    const char* build_index = nullptr;
+    const char* query = nullptr;
+    // Unix domain socket to serve queries on.
+    const char* serve = nullptr;
+    // Git revisions to search instead of files.
+    std::vector<const char*> revs;
+    // Bitwise or of NORM_* flags.
+    unsigned normalize = 0;
+    // Directories to search with -r.
+    std::vector<const char*> dirs;
+    std::vector<const char*> excludes;
+};
+
+const char* PROGRAM = nullptr;
+
+// Prints an error message prefixed by the program name, and exits.
+[[noreturn]] void fail(const char* const format, ...)
+    __attribute__((__format__(__printf__, 1, 2)));
+
+void fail(const char* const format, ...) {
+    std::va_list args;
+    va_start(args, format);
+    std::fprintf(stderr, "%s: ", PROGRAM);
+    std::vfprintf(stderr, format, args);
+    std::fputc('\n', stderr);
+    va_end(args);
+    std::exit(1);
+}
+
+// Parses a size in bytes with an optional K, M, or G suffix.
+std::optional<std::size_t> parse_size(const char* const str) {
+    char* end;
+    errno = 0;
+    const auto value = std::strtoull(str, &end, 10);
+    if (errno != 0 || end == str) {
+        return std::nullopt;
+    }
+    int shift = 0;
+    switch (*end) {
+    case 'K':
+        shift = 10;
+        break;
+    case 'M':
+        shift = 20;
+        break;
+    case 'G':
+        shift = 30;
+        break;
+    case '\0':
+        return value;
+    default:
+        return std::nullopt;
+    }
+    if (end[1] != '\0' || value > (std::numeric_limits<std::size_t>::max() >>
+                                   shift)) {
+        return std::nullopt;
+    }
+    return static_cast<std::size_t>(value) << shift;
+}
+
+// =============================================================================
+//       I/O helpers
+// =============================================================================
+
+class Input;
+
+// Identifies a version of a file, to detect changes.
+struct FileStamp {
+    std::uint64_t size;
+    std::int64_t mtime_ns;
+    std::uint64_t ino;
+
+    bool operator==(const FileStamp& other) const {
+        return size == other.size && mtime_ns == other.mtime_ns &&
+               ino == other.ino;
+    }
+};
+
+// Zero-based line number.
+using LineNo = std::size_t;
+
+// Dense integer ID for a distinct line.
+using LineId = std::uint32_t;
+
+struct LineRange {
+    const Input* input;
+    LineNo start;  // inclusive
+    LineNo end;    // exclusive
+};
+
+// Appends everything up to the end of the file to text. On failure, returns
+// false and sets errno.
+bool read_all(const int fd, std::string& text) {
+    char buf[1 << 16];
+    while (true) {
+        const auto n = ::read(fd, buf, sizeof buf);
+        if (n == 0) {
+            return true;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        text.append(buf, static_cast<std::size_t>(n));
+    }
+}
+
+// Child process whose standard output, and optionally standard input, are
+// connected to pipes.
+class Child {
+   public:
+    // Runs args[0], searching $PATH, and fails if it cannot be started.
+    explicit Child(const std::vector<std::string>& args,
+                   const bool input = false) {
+        // Keep other children from inheriting the pipes, which would stop
+        // them from seeing the end of their input. Children can be started
+        // from several threads at once, so the pipes must be close-on-exec
+        // before any other child is spawned.
+        std::lock_guard<std::mutex> lock(spawn_mutex_);
+        int out[2];
+        int in[2] = {-1, -1};
+        if (pipe(out) == -1 || (input && pipe(in) == -1)) {
+            fail("pipe: %s", std::strerror(errno));
+        }
+        for (const int fd : {out[0], out[1], in[0], in[1]}) {
+            if (fd != -1 && fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+                fail("fcntl: %s", std::strerror(errno));
+            }
+        }
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+        if (input) {
+            posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+        }
+        std::vector<char*> argv;
+        for (const auto& arg : args) {
+            argv.push_back(const_cast<char*>(arg.c_str()));
+        }
+        argv.push_back(nullptr);
+        const int err = posix_spawnp(&pid_, argv[0], &actions, nullptr,
+                                     argv.data(), environ);
+        posix_spawn_file_actions_destroy(&actions);
+        if (err != 0) {
+            fail("%s: %s", argv[0], std::strerror(err));
+        }
+        ::close(out[1]);
+        out_ = out[0];
+        if (input) {
+            ::close(in[0]);
+            in_ = in[1];
+        }
+    }
+
+    Child(const Child&) = delete;
+    Child& operator=(const Child&) = delete;
+
+    ~Child() { wait(); }
+
+    int in() const { return in_; }
+    int out() const { return out_; }
+
+    // Give up the pipes, which the caller must then close.
+    int take_in() { return std::exchange(in_, -1); }
+    int take_out() { return std::exchange(out_, -1); }
+
+    // Closes the pipes and waits for the process to exit. Returns true if it
+    // exited successfully.
+    bool wait() {
+        for (int* fd : {&in_, &out_}) {
+            if (*fd != -1) {
+                ::close(std::exchange(*fd, -1));
+            }
+        }
+        if (pid_ != -1) {
+            int status;
+            while (waitpid(pid_, &status, 0) == -1 && errno == EINTR) {
+            }
+            pid_ = -1;
+            success_ = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        }
+        return success_;
+    }
+
+   private:
+    // Held while creating pipes and spawning.
+    static inline std::mutex spawn_mutex_;
+
+    pid_t pid_ = -1;
+    int in_ = -1;
+    int out_ = -1;
+    bool success_ = false;
+};
+
+// Returns the program that decompresses data starting with the given bytes,
+// if they are the magic number of gzip or zstd.
+const char* compression(const char* const data, const std::size_t size) {
+    const auto starts = [&](const std::string_view magic) {
+        return size >= magic.size() &&
+               std::memcmp(data, magic.data(), magic.size()) == 0;
+    };
+    if (starts("\x1f\x8b")) {
+        return "gzip";
+    }
+    if (starts("\x28\xb5\x2f\xfd")) {
+        return "zstd";
+    }
+    return nullptr;
+}
+
+// Text file mapped into memory. Lines are stored as offsets into the mapping,
+// so reading a file costs no allocations beyond the line table. Files
+// compressed with gzip or zstd are decompressed by a child process, into
+// memory when read, or line by line when streamed or scanned.
+class Input {
+   public:
+    explicit Input(std::string filename) : filename_(std::move(filename)) {}
+
+    Input(Input&& other) noexcept
+        : filename_(std::move(other.filename_)),
+          data_(std::exchange(other.data_, nullptr)),
+          size_(std::exchange(other.size_, 0)),
+          pos_(other.pos_),
+          stamp_(other.stamp_),
+          num_lines_(other.num_lines_),
+          lines_(std::move(other.lines_)),
+          marks_(std::move(other.marks_)),
+          hashes_(std::move(other.hashes_)),
+          ids_(std::move(other.ids_)),
+          fd_(std::exchange(other.fd_, -1)),
+          buf_(std::move(other.buf_)),
+          buf_begin_(other.buf_begin_),
+          buf_end_(other.buf_end_),
+          compression_(other.compression_),
+          child_(std::move(other.child_)),
+          feeder_(std::move(other.feeder_)) {}
+
+    Input(const Input&) = delete;
+    Input& operator=(const Input&) = delete;
+    Input& operator=(Input&&) = delete;
+
+    ~Input() {
+        unmap();
+        if (fd_ != -1) {
+            ::close(fd_);
+        }
+        // Stop the decompressor before the thread feeding it.
+        child_.reset();
+        if (feeder_.joinable()) {
+            feeder_.join();
+        }
+    }
+
+    const char* name() const { return filename_.c_str(); }
+
+    bool exists() const {
+        return std::filesystem::is_regular_file(filename_) || is_stream();
+    }
+
+    // Whether the file is a pipe, socket, or device, which can only be read
+    // once and in order, like standard input.
+    bool is_stream() const {
+        if (is_stdin()) {
+            return true;
+        }
+        const auto status = std::filesystem::status(filename_);
+        return std::filesystem::is_fifo(status) ||
+               std::filesystem::is_socket(status) ||
+               std::filesystem::is_character_file(status);
+    }
+
+    // Opens the file to read it with stream(), which works on any kind of file,
+    // instead of mapping it. On failure, returns false and sets errno.
+    // Compressed files are decompressed, even from a pipe.
+    bool open_stream() {
+        if (!open_stream(is_stdin() ? dup(STDIN_FILENO)
+                                    : ::open(name(), O_RDONLY))) {
+            return false;
+        }
+        // Read the magic number into the buffer, which works on pipes too.
+        while (buf_end_ < MAGIC_BYTES) {
+            const auto n = ::read(fd_, buf_.data() + buf_end_,
+                                  MAGIC_BYTES - buf_end_);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                return false;
+            }
+            if (n == 0) {
+                break;
+            }
+            buf_end_ += static_cast<std::size_t>(n);
+        }
+        compression_ = compression(buf_.data(), buf_end_);
+        if (compression_ != nullptr) {
+            decompress_stream();
+        }
+        return true;
+    }
+
+    // Like open_stream(), but reads from a file descriptor, which it closes,
+    // without checking for compression. Unless fatal, a read error ends the
+    // stream instead of exiting.
+    bool open_stream(const int fd, const bool fatal = true) {
+        fd_ = fd;
+        fatal_ = fatal;
+        buf_.resize(1 << 16);
+        return fd_ != -1;
+    }
+
+    // Reads the whole file into memory, unlike open(), so that it can be used
+    // even if the file is truncated later. On failure, returns false and sets
+    // errno.
+    bool load() {
+        const int fd = ::open(name(), O_RDONLY);
+        std::string text;
+        if (fd == -1 || !read_all(fd, text)) {
+            const int err = errno;
+            if (fd != -1) {
+                ::close(fd);
+            }
+            errno = err;
+            return false;
+        }
+        ::close(fd);
+        assign(text);
+        return true;
+    }
+
+    // Uses the given text instead of reading the file.
+    void assign(const std::string_view text) {
+        unmap();
+        buf_.assign(text.begin(), text.end());
+        data_ = buf_.data();
+        size_ = buf_.size();
+    }
+
+    // Reads the next line after open_stream(), which is valid until the next
+    // call. Only the current line is buffered.
+    bool stream(std::string_view& text) {
+        while (true) {
+            const char* const begin = buf_.data() + buf_begin_;
+            const auto* const newline = static_cast<const char*>(
+                std::memchr(begin, '\n', buf_end_ - buf_begin_));
+            if (newline != nullptr || (fd_ == -1 && buf_end_ > buf_begin_)) {
+                const auto length = newline == nullptr
+                                        ? buf_end_ - buf_begin_
+                                        : static_cast<std::size_t>(
+                                              newline - begin);
+                text = std::string_view(begin, length);
+                buf_begin_ += newline == nullptr ? length : length + 1;
+                ++num_lines_;
+                return true;
+            }
+            if (fd_ == -1) {
+                return false;
+            }
+            // Move the partial line to the front, growing if it fills the
+            // whole buffer, and read more after it.
+            std::memmove(buf_.data(), begin, buf_end_ - buf_begin_);
+            buf_end_ -= buf_begin_;
+            buf_begin_ = 0;
+            if (buf_end_ == buf_.size()) {
+                buf_.resize(buf_.size() * 2);
+            }
+            const auto n = ::read(fd_, buf_.data() + buf_end_,
+                                  buf_.size() - buf_end_);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (fatal_) {
+                    fail("%s: %s", name(), std::strerror(errno));
+                }
+                ::close(fd_);
+                fd_ = -1;
+                buf_begin_ = buf_end_ = 0;
+                return false;
+            }
+            if (n == 0) {
+                ::close(fd_);
+                fd_ = -1;
+                if (child_ != nullptr && !child_->wait()) {
+                    fail("%s: cannot decompress", name());
+                }
+                if (feeder_.joinable()) {
+                    feeder_.join();
+                }
+            }
+            buf_end_ += static_cast<std::size_t>(n);
+        }
+    }
+
+    // Maps the file into memory. On failure, returns false and sets errno.
+    bool open() {
+        const int fd = ::open(name(), O_RDONLY);
+        if (fd == -1) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == -1) {
+            const int err = errno;
+            ::close(fd);
+            errno = err;
+            return false;
+        }
+        size_ = static_cast<std::size_t>(st.st_size);
+#ifdef __APPLE__
+        const auto& mtime = st.st_mtimespec;
+#else
+        const auto& mtime = st.st_mtim;
+#endif
+        stamp_ = FileStamp{
+            size_, std::int64_t{mtime.tv_sec} * 1000000000 + mtime.tv_nsec,
+            static_cast<std::uint64_t>(st.st_ino)};
+        if (size_ != 0) {
+            void* const addr =
+                mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr == MAP_FAILED) {
+                const int err = errno;
+                ::close(fd);
+                errno = err;
+                size_ = 0;
+                return false;
+            }
+            madvise(addr, size_, MADV_SEQUENTIAL);
+            data_ = static_cast<const char*>(addr);
+            // Leave compressed files to be decompressed by a worker.
+            compression_ = compression(data_, size_);
+            if (compression_ != nullptr) {
+                unmap();
+                size_ = 0;
+            }
+        }
+        ::close(fd);
+        return true;
+    }
+
+    // Whether the first n bytes contain a NUL, suggesting a binary file.
+    bool binary(const std::size_t n) const {
+        return size_ != 0 && std::memchr(data_, 0, std::min(n, size_));
+    }
+
+    // Unmaps the file. Line numbers from scan() remain valid for reread().
+    void unmap() {
+        if (data_ != nullptr && data_ != buf_.data()) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+        data_ = nullptr;
+    }
+
+    // Like std::getline, the final line only counts if it is nonempty.
+    bool getline() {
+        Line line;
+        if (!next(line)) {
+            return false;
+        }
+        lines_.push_back(line);
+        return true;
+    }
+
+    // Like getline, but only keeps the offset of every MARK_INTERVAL-th line
+    // instead of building the line table.
+    bool scan(std::string_view& text) {
+        if (num_lines_ % MARK_INTERVAL == 0) {
+            marks_.push_back(pos_);
+        }
+        if (compression_ != nullptr) {
+            if (child_ == nullptr) {
+                child_ = decompressor();
+                open_stream(child_->take_out());
+            }
+            if (!stream(text)) {
+                return false;
+            }
+            pos_ += text.size() + 1;
+            return true;
+        }
+        Line line;
+        if (!next(line)) {
+            return false;
+        }
+        text = std::string_view(data_ + line.offset, line.length);
+        return true;
+    }
+
+    // Reads lines [first, last) from disk using the marks left by scan().
+    std::vector<std::string> reread(const LineNo first,
+                                    const LineNo last) const {
+        std::vector<std::string> result;
+        // Decompressed text can only be read in order, from the start.
+        const auto child =
+            compression_ != nullptr ? decompressor() : nullptr;
+        const int fd =
+            child != nullptr ? child->out() : ::open(name(), O_RDONLY);
+        if (fd == -1) {
+            fail("%s: %s", name(), std::strerror(errno));
+        }
+        auto offset = static_cast<off_t>(marks_[first / MARK_INTERVAL]);
+        auto skip = first % MARK_INTERVAL;
+        off_t skip_bytes = child != nullptr ? offset : 0;
+        std::string line;
+        char buf[1 << 16];
+        while (result.size() < last - first) {
+            const auto n = child != nullptr
+                               ? ::read(fd, buf, sizeof buf)
+                               : pread(fd, buf, sizeof buf, offset);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                fail("%s: %s", name(), std::strerror(errno));
+            }
+            if (n > 0 && skip_bytes >= n) {
+                skip_bytes -= n;
+                continue;
+            }
+            if (n == 0) {
+                // Like getline, the final line may lack a newline. If the
+                // file was truncated since it was scanned, pad with blanks.
+                result.push_back(std::move(line));
+                result.resize(last - first);
+                break;
+            }
+            offset += n;
+            const char* p = buf + std::exchange(skip_bytes, 0);
+            const char* const end = buf + n;
+            while (p != end && result.size() < last - first) {
+                const auto* newline = static_cast<const char*>(
+                    std::memchr(p, '\n', static_cast<std::size_t>(end - p)));
+                if (newline == nullptr) {
+                    line.append(p, end);
+                    break;
+                }
+                if (skip > 0) {
+                    --skip;
+                } else {
+                    line.append(p, newline);
+                    result.push_back(std::move(line));
+                }
+                line.clear();
+                p = newline + 1;
+            }
+        }
+        if (child == nullptr) {
+            ::close(fd);
+        }
+        return result;
+    }
+
+    std::string_view get(const LineNo lineno) const {
+        const auto line = lines_[lineno];
+        return std::string_view(data_ + line.offset, line.length);
+    }
+
+    // Reads all remaining lines.
+    void read() {
+        if (compression_ != nullptr && data_ == nullptr) {
+            decompress();
+        }
+        while (getline()) {
+        }
+        ids_.resize(lines_.size());
+    }
+
+    LineNo end() const { return num_lines_; }
+
+    FileStamp stamp() const { return stamp_; }
+
+    struct Line {
+        std::size_t offset;
+        std::size_t length;
+    };
+
+    const Line* lines() const { return lines_.data(); }
+
+    // Uses a line table and line hashes saved from a previous read() instead
+    // of reading the file.
+    void restore(const Line* const lines, const std::uint64_t* const hashes,
+                 const LineNo num_lines) {
+        if (compression_ != nullptr && data_ == nullptr) {
+            decompress();
+        }
+        lines_.assign(lines, lines + num_lines);
+        hashes_.assign(hashes, hashes + num_lines);
+        ids_.resize(num_lines);
+        num_lines_ = num_lines;
+        pos_ = size_;
+    }
+
+    // Line hashes, filled in by ingest() only when caching.
+    const std::uint64_t* hashes() const { return hashes_.data(); }
+    std::uint64_t* hashes() { return hashes_.data(); }
+    bool has_hashes() const { return hashes_.size() == num_lines_; }
+    void reserve_hashes() { hashes_.resize(num_lines_); }
+
+    // Interned line IDs, filled in by ingest().
+    const LineId* ids() const { return ids_.data(); }
+    LineId* ids() { return ids_.data(); }
+
+   private:
+    static constexpr LineNo MARK_INTERVAL = 1024;
+
+    // Whether the file is "-", meaning standard input.
+    bool is_stdin() const { return filename_ == "-"; }
+
+    // Bytes read by open_stream() to detect compression.
+    static constexpr std::size_t MAGIC_BYTES = 4;
+
+    // Starts decompressing the file to a pipe.
+    std::unique_ptr<Child> decompressor() const {
+        return std::make_unique<Child>(
+            std::vector<std::string>{compression_, "-dc", "--", filename_});
+    }
+
+    // Decompresses the rest of the stream, passing the decompressor the bytes
+    // already buffered and then the rest of fd_ from another thread.
+    void decompress_stream() {
+        child_ = std::make_unique<Child>(
+            std::vector<std::string>{compression_, "-dc"}, true);
+        feeder_ = std::thread([in = child_->take_in(), fd = fd_,
+                               head = std::string(buf_.data(), buf_end_)] {
+            // Let writes fail with EPIPE if the decompressor exits early,
+            // rather than killing the process.
+            sigset_t set;
+            sigemptyset(&set);
+            sigaddset(&set, SIGPIPE);
+            pthread_sigmask(SIG_BLOCK, &set, nullptr);
+            char buf[1 << 16];
+            std::string_view pending = head;
+            while (true) {
+                while (!pending.empty()) {
+                    const auto n = ::write(in, pending.data(), pending.size());
+                    if (n < 0 && errno != EINTR) {
+                        break;
+                    }
+                    pending.remove_prefix(n < 0 ? 0
+                                                : static_cast<std::size_t>(n));
+                }
+                if (!pending.empty()) {
+                    break;
+                }
+                const auto n = ::read(fd, buf, sizeof buf);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    break;
+                }
+                pending = std::string_view(buf, static_cast<std::size_t>(n));
+            }
+            ::close(in);
+            ::close(fd);
+        });
+        fd_ = child_->take_out();
+        buf_end_ = 0;
+    }
+
+    // Reads the whole decompressed file into memory.
+    void decompress() {
+        const auto child = decompressor();
+        std::string text;
+        if (!read_all(child->out(), text)) {
+            fail("%s: %s", name(), std::strerror(errno));
+        }
+        if (!child->wait()) {
+            fail("%s: cannot decompress", name());
+        }
+        assign(text);
+    }
+
+    bool next(Line& line) {
+        if (pos_ == size_) {
+            return false;
+        }
+        const char* const start = data_ + pos_;
+        const auto* const newline = static_cast<const char*>(
+            std::memchr(start, '\n', size_ - pos_));
+        const auto length = newline == nullptr
+                                ? size_ - pos_
+                                : static_cast<std::size_t>(newline - start);
+        line = Line{pos_, length};
+        pos_ += newline == nullptr ? length : length + 1;
+        ++num_lines_;
+        return true;
+    }
+
+    std::string filename_;
+    const char* data_ = nullptr;
+    std::size_t size_ = 0;
+    std::size_t pos_ = 0;
+    FileStamp stamp_{};
+    LineNo num_lines_ = 0;
+    std::vector<Line> lines_;
+    std::vector<std::size_t> marks_;
+    std::vector<std::uint64_t> hashes_;
+    std::vector<LineId> ids_;
+    // Used by stream() instead of data_.
+    int fd_ = -1;
+    std::vector<char> buf_;
+    std::size_t buf_begin_ = 0;
+    std::size_t buf_end_ = 0;
+    // Whether stream() exits on a read error.
+    bool fatal_ = true;
+    // Program that decompresses the file, if it is compressed.
+    const char* compression_ = nullptr;
+    // Decompresses the file for stream() and scan().
+    std::unique_ptr<Child> child_;
+    // Copies a compressed stream to child_.
+    std::thread feeder_;
+};
+
+// =============================================================================
+//       Hashing
+// =============================================================================
+
+// Hashes the text of a line, eight bytes at a time.
+std::uint64_t hash_line(const std::string_view line) {
+    constexpr std::uint64_t K = 0x9e3779b97f4a7c15ull;
+    auto mix = [](std::uint64_t x) {
+        x ^= x >> 32;
+        x *= 0xd6e8feb86659fd93ull;
+        x ^= x >> 32;
+        return x;
+    };
+    std::uint64_t h = K ^ line.size();
+    const char* p = line.data();
+    auto n = line.size();
+    for (; n >= 8; p += 8, n -= 8) {
+        std::uint64_t word;
+        std::memcpy(&word, p, 8);
+        h = mix((h ^ word) * K);
+    }
+    if (n != 0) {
+        std::uint64_t word = 0;
+        std::memcpy(&word, p, n);
+        h = mix((h ^ word) * K);
+    }
+    return mix(h);
+}
+
+// Line normalizations, as bit flags. Lines that are equal after normalization
+// are treated as identical.
+constexpr unsigned NORM_LEADING = 1 << 0;  // ignore leading whitespace
+constexpr unsigned NORM_SPACE = 1 << 1;    // collapse whitespace runs
+constexpr unsigned NORM_CASE = 1 << 2;     // ignore ASCII case
+
+bool is_space(const char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+
+// Yields the bytes of a normalized line one at a time, without copying it.
+// With NORM_SPACE, each run of whitespace becomes a single space, and trailing
+// whitespace is dropped.
+class Normalizer {
+   public:
+    Normalizer(const std::string_view line, const unsigned mode)
+        : line_(line), mode_(mode) {
+        if (mode & NORM_LEADING) {
+            while (pos_ < line_.size() && is_space(line_[pos_])) {
+                ++pos_;
+            }
+        }
+    }
+
+    // Continues after a run of whitespace that has not been output yet.
+    void after_space() { space_ = (mode_ & NORM_SPACE) != 0; }
+
+    // Returns the next byte, or -1 at the end.
+    int next() {
+        for (; pos_ < line_.size(); ++pos_) {
+            auto c = line_[pos_];
+            if ((mode_ & NORM_SPACE) && is_space(c)) {
+                space_ = true;
+                continue;
+            }
+            if (space_) {
+                space_ = false;
+                return ' ';
+            }
+            if ((mode_ & NORM_CASE) && c >= 'A' && c <= 'Z') {
+                c = static_cast<char>(c + ('a' - 'A'));
+            }
+            ++pos_;
+            return static_cast<unsigned char>(c);
+        }
+        return -1;
+    }
+
+   private:
+    std::string_view line_;
+    unsigned mode_;
+    std::size_t pos_ = 0;
+    bool space_ = false;
+};
+
+// Hashes a stream of bytes eight at a time, like hash_line, for text whose
+// length is not known in advance.
+class StreamHasher {
+   public:
+    void push(const char c) {
+        buf_[fill_++] = c;
+        if (fill_ >= 16) {
+            flush();
+        }
+    }
+
+    // Appends n bytes, where n is at most 16.
+    void append(const char* const p, const std::size_t n) {
+        std::memcpy(buf_ + fill_, p, n);
+        fill_ += n;
+        if (fill_ >= 16) {
+            flush();
+        }
+    }
+
+    std::uint64_t finish() {
+        std::size_t i = 0;
+        for (; i + 8 <= fill_; i += 8) {
+            word(buf_ + i);
+        }
+        if (i != fill_) {
+            char last[8] = {};
+            std::memcpy(last, buf_ + i, fill_ - i);
+            word(last);
+        }
+        return mix((h_ ^ (length_ + fill_)) * K);
+    }
+
+   private:
+    static constexpr std::uint64_t K = 0x9e3779b97f4a7c15ull;
+
+    static std::uint64_t mix(std::uint64_t x) {
+        x ^= x >> 32;
+        x *= 0xd6e8feb86659fd93ull;
+        x ^= x >> 32;
+        return x;
+    }
+
+    void word(const char* const p) {
+        std::uint64_t w;
+        std::memcpy(&w, p, 8);
+        h_ = mix((h_ ^ w) * K);
+    }
+
+    // Hashes all complete words, keeping the remainder.
+    void flush() {
+        std::size_t i = 0;
+        for (; i + 8 <= fill_; i += 8) {
+            word(buf_ + i);
+        }
+        length_ += i;
+        std::memmove(buf_, buf_ + i, fill_ - i);
+        fill_ -= i;
+    }
+
+    // Holds fewer than 16 bytes between calls, so a block always fits.
+    char buf_[32];
+    std::size_t fill_ = 0;
+    std::uint64_t length_ = 0;
+    std::uint64_t h_ = K;
+};
+
+#if defined(__SSE2__) || (defined(__ARM_NEON) && defined(__aarch64__))
+// Sixteen bytes of a line, classified in parallel.
+struct Block {
+    // Bit i is set if byte i is whitespace.
+    unsigned spaces;
+    // The bytes, lowercased if requested.
+    char bytes[16];
+
+    Block(const char* const p, const bool fold) {
+#if defined(__SSE2__)
+        auto x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        const auto ctrl = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8(8)),
+                                        _mm_cmplt_epi8(x, _mm_set1_epi8(14)));
+        const auto space = _mm_or_si128(
+            ctrl, _mm_cmpeq_epi8(x, _mm_set1_epi8(' ')));
+        spaces = static_cast<unsigned>(_mm_movemask_epi8(space));
+        if (fold) {
+            const auto upper =
+                _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('A' - 1)),
+                              _mm_cmplt_epi8(x, _mm_set1_epi8('Z' + 1)));
+            x = _mm_add_epi8(x, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(bytes), x);
+#else
+        auto x = vld1q_u8(reinterpret_cast<const std::uint8_t*>(p));
+        const auto space =
+            vorrq_u8(vandq_u8(vcgeq_u8(x, vdupq_n_u8('\t')),
+                              vcleq_u8(x, vdupq_n_u8('\r'))),
+                     vceqq_u8(x, vdupq_n_u8(' ')));
+        static const std::uint8_t weights[16] = {
+            1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+        const auto bits = vandq_u8(space, vld1q_u8(weights));
+        spaces = vaddv_u8(vget_low_u8(bits)) |
+                 static_cast<unsigned>(vaddv_u8(vget_high_u8(bits))) << 8;
+        if (fold) {
+            const auto upper = vandq_u8(vcgeq_u8(x, vdupq_n_u8('A')),
+                                        vcleq_u8(x, vdupq_n_u8('Z')));
+            x = vaddq_u8(x, vandq_u8(upper, vdupq_n_u8(0x20)));
+        }
+        vst1q_u8(reinterpret_cast<std::uint8_t*>(bytes), x);
+#endif
+    }
+};
+#endif
+
+// Hashes a line after normalization. Lines are classified sixteen bytes at a
+// time, and blocks without whitespace to collapse are hashed whole.
+std::uint64_t hash_normalized(const std::string_view line,
+                              const unsigned mode) {
+    StreamHasher hasher;
+    const char* p = line.data();
+    const char* const end = p + line.size();
+#if defined(__SSE2__) || (defined(__ARM_NEON) && defined(__aarch64__))
+    const bool fold = mode & NORM_CASE;
+    const bool collapse = mode & NORM_SPACE;
+    bool leading = mode & NORM_LEADING;
+    bool space = false;
+    for (; end - p >= 16; p += 16) {
+        const Block block(p, fold);
+        unsigned skip = 0;
+        if (leading) {
+            if (block.spaces == 0xffff) {
+                continue;
+            }
+            skip = static_cast<unsigned>(__builtin_ctz(~block.spaces));
+            leading = false;
+        }
+        if (!collapse || (block.spaces >> skip) == 0) {
+            if (space) {
+                hasher.push(' ');
+                space = false;
+            }
+            hasher.append(block.bytes + skip, 16 - skip);
+            continue;
+        }
+        for (auto i = skip; i < 16; ++i) {
+            if (block.spaces >> i & 1) {
+                space = true;
+                continue;
+            }
+            if (space) {
+                hasher.push(' ');
+                space = false;
+            }
+            hasher.push(block.bytes[i]);
+        }
+    }
+    // Finish the tail with the scalar normalizer, carrying over its state.
+    Normalizer tail(std::string_view(p, static_cast<std::size_t>(end - p)),
+                    leading ? mode : mode & ~NORM_LEADING);
+    if (space) {
+        tail.after_space();
+    }
+#else
+    Normalizer tail(line, mode);
+#endif
+    for (int c; (c = tail.next()) != -1;) {
+        hasher.push(static_cast<char>(c));
+    }
+    return hasher.finish();
+}
+
+// Hashes a line, first normalizing it if mode is nonzero.
+std::uint64_t hash_line(const std::string_view line, const unsigned mode) {
+    return mode == 0 ? hash_line(line) : hash_normalized(line, mode);
+}
+
+// Returns true if the lines are equal after normalization.
+bool same_text(const std::string_view a, const std::string_view b,
+               const unsigned mode) {
+    if (mode == 0) {
+        return a == b;
+    }
+    Normalizer x(a, mode);
+    Normalizer y(b, mode);
+    for (;;) {
+        const int c = x.next();
+        if (c != y.next()) {
+            return false;
+        }
+        if (c == -1) {
+            return true;
+        }
+    }
+}
+
+// 128-bit fingerprint of a window of lines.
+struct Fingerprint {
+    std::uint64_t a;
+    std::uint64_t b;
+
+    bool operator==(const Fingerprint& other) const {
+        return a == other.a && b == other.b;
+    }
+};
+
+struct FingerprintHash {
+    std::size_t operator()(const Fingerprint& fp) const {
+        return static_cast<std::size_t>(fp.a ^ (fp.b >> 3));
+    }
+};
+
+// Computes fingerprints as a pair of polynomial hashes of the line hashes,
+// modulo the Mersenne prime 2^61 - 1, with independent bases. Lines are added
+// one at a time so that each window extends the previous one.
+class Hasher {
+   public:
+    Fingerprint get() const { return Fingerprint{a_, b_}; }
+
+    void combine(const std::uint64_t line_hash) {
+        a_ = add(mul(a_, BASE_A), reduce(line_hash));
+        b_ = add(mul(b_, BASE_B), reduce(line_hash >> 3 ^ line_hash << 29));
+    }
+
+   private:
+    friend class RollingHasher;
+
+    static constexpr std::uint64_t P = (std::uint64_t{1} << 61) - 1;
+    static constexpr std::uint64_t BASE_A = 0x1b8a5e9c2d3f4a61ull % P;
+    static constexpr std::uint64_t BASE_B = 0x0f2c9d7e4b6a8133ull % P;
+
+    static std::uint64_t reduce(const std::uint64_t x) {
+        const auto r = (x & P) + (x >> 61);
+        return r >= P ? r - P : r;
+    }
+
+    static std::uint64_t add(const std::uint64_t x, const std::uint64_t y) {
+        const auto r = x + y;
+        return r >= P ? r - P : r;
+    }
+
+    static std::uint64_t mul(const std::uint64_t x, const std::uint64_t y) {
+        const auto product = static_cast<unsigned __int128>(x) * y;
+        const auto lo = static_cast<std::uint64_t>(product) & P;
+        const auto hi = static_cast<std::uint64_t>(product >> 61);
+        return add(lo, hi);
+    }
+
+    std::uint64_t a_ = 17;
+    std::uint64_t b_ = 31;
+};
+
+// Computes the same fingerprints as Hasher for windows of one fixed length, in
+// constant time per window. Windows slide towards the start of the input: each
+// new line is prepended, and once the window is full the caller also passes
+// the hash of the last line, which drops out.
+class RollingHasher {
+   public:
+    explicit RollingHasher(const std::size_t len) {
+        for (std::size_t i = 0; i < len; ++i) {
+            pow_a_ = Hasher::mul(pow_a_, Hasher::BASE_A);
+            pow_b_ = Hasher::mul(pow_b_, Hasher::BASE_B);
+        }
+        // Hasher starts from a nonzero state, which is scaled by every line.
+        init_a_ = Hasher::mul(17, pow_a_);
+        init_b_ = Hasher::mul(31, pow_b_);
+    }
+
+    Fingerprint get() const {
+        return Fingerprint{Hasher::add(a_, init_a_), Hasher::add(b_, init_b_)};
+    }
+
+    void push(const std::uint64_t line_hash) {
+        a_ = Hasher::add(Hasher::mul(a_, Hasher::BASE_A),
+                         Hasher::reduce(line_hash));
+        b_ = Hasher::add(Hasher::mul(b_, Hasher::BASE_B),
+                         Hasher::reduce(line_hash >> 3 ^ line_hash << 29));
+    }
+
+    void roll(const std::uint64_t in, const std::uint64_t out) {
+        push(in);
+        a_ = sub(a_, Hasher::mul(Hasher::reduce(out), pow_a_));
+        b_ = sub(b_, Hasher::mul(Hasher::reduce(out >> 3 ^ out << 29), pow_b_));
+    }
+
+   private:
+    static std::uint64_t sub(const std::uint64_t x, const std::uint64_t y) {
+        return x >= y ? x - y : x + Hasher::P - y;
+    }
+
+    std::uint64_t pow_a_ = 1;
+    std::uint64_t pow_b_ = 1;
+    std::uint64_t init_a_;
+    std::uint64_t init_b_;
+    std::uint64_t a_ = 0;
+    std::uint64_t b_ = 0;
+};
+
+// Returns the fingerprint of every window of len lines by where it starts,
+// given the hash of each line. These are the same as from Hasher.
+std::vector<Fingerprint> fingerprint_windows(
+    const std::vector<std::uint64_t>& hashes, const std::size_t len) {
+    std::vector<Fingerprint> fps;
+    if (hashes.size() < len) {
+        return fps;
+    }
+    fps.resize(hashes.size() - len + 1);
+    RollingHasher hasher(len);
+    auto start = fps.size() - 1;
+    for (auto i = hashes.size(); i > start; --i) {
+        hasher.push(hashes[i - 1]);
+    }
+    fps[start] = hasher.get();
+    while (start > 0) {
+        --start;
+        hasher.roll(hashes[start], hashes[start + len]);
+        fps[start] = hasher.get();
+    }
+    return fps;
+}
+
+// =============================================================================
+//       Thread pool
+// =============================================================================
+
+// Index of the pool worker running on this thread, or -1 for other threads.
+thread_local int WORKER = -1;
+
+// Fixed set of threads, each with its own task queue. Workers take tasks from
+// the back of their own queue and steal from the front of others' queues when
+// theirs is empty, so one long task never holds up the rest.
+class ThreadPool {
+   public:
+    using Task = std::function<void()>;
+
+    explicit ThreadPool(const unsigned num_threads) {
+        for (unsigned i = 0; i < num_threads; ++i) {
+            queues_.push_back(std::make_unique<Queue>());
+        }
+        for (unsigned i = 0; i < num_threads; ++i) {
+            threads_.emplace_back([this, i] { run(i); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    unsigned size() const { return static_cast<unsigned>(threads_.size()); }
+
+    // Queues a task. Tasks may submit further tasks.
+    void submit(Task task) {
+        const auto i = WORKER != -1 ? static_cast<std::size_t>(WORKER)
+                                    : next_++ % queues_.size();
+        {
+            std::lock_guard<std::mutex> lock(queues_[i]->mutex);
+            queues_[i]->tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++queued_;
+            ++pending_;
+        }
+        wake_.notify_one();
+    }
+
+    // Blocks until every submitted task has finished.
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this] { return pending_ == 0; });
+    }
+
+   private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    void run(const unsigned self) {
+        WORKER = static_cast<int>(self);
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [this] { return queued_ > 0 || stop_; });
+                if (queued_ == 0) {
+                    return;
+                }
+                // Claim a task. One is guaranteed to be in some queue.
+                --queued_;
+            }
+            take(self)();
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (--pending_ == 0) {
+                done_.notify_all();
+            }
+        }
+    }
+
+    Task take(const unsigned self) {
+        const auto n = queues_.size();
+        for (;;) {
+            for (std::size_t k = 0; k < n; ++k) {
+                auto& queue = *queues_[(self + k) % n];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                if (queue.tasks.empty()) {
+                    continue;
+                }
+                Task task;
+                if (k == 0) {
+                    task = std::move(queue.tasks.back());
+                    queue.tasks.pop_back();
+                } else {
+                    task = std::move(queue.tasks.front());
+                    queue.tasks.pop_front();
+                }
+                return task;
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    std::size_t queued_ = 0;
+    std::size_t pending_ = 0;
+    std::size_t next_ = 0;
+    bool stop_ = false;
+};
+
+// Queue for handing items from pool workers to a dedicated thread. Pushing
+// blocks while the queue is full, so a slow consumer holds back producers
+// instead of letting items pile up.
+template <typename T>
+class BoundedQueue {
+   public:
+    explicit BoundedQueue(const std::size_t capacity) : capacity_(capacity) {}
+
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [this] { return items_.size() < capacity_; });
+        items_.push_back(std::move(item));
+        not_empty_.notify_one();
+    }
+
+    // Returns the next item, or nullopt once the queue is closed and empty.
+    std::optional<T> pop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this] { return !items_.empty() || closed_; });
+        if (items_.empty()) {
+            return std::nullopt;
+        }
+        T item = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return item;
+    }
+
+    // Lets pop() return nullopt once the remaining items are taken.
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        not_empty_.notify_all();
+    }
+
+   private:
+    std::size_t capacity_;
+    std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+    std::deque<T> items_;
+    bool closed_ = false;
+};
+
+// =============================================================================
+//       Statistics
+// =============================================================================
+
+// Timings of each phase and counts of the work done, printed with --stats.
+// Phases are recorded as they end, so each is named for the work done since
+// the previous one. Counts may be added from any thread, but callers should
+// add them in bulk since each takes a lock.
+class Stats {
+   public:
+    bool enabled() const { return enabled_; }
+
+    void start() {
+        enabled_ = true;
+        start_ = last_ = Clock::now();
+        start_cpu_ = last_cpu_ = cpu_seconds();
+    }
+
+    void phase(const char* const name) {
+        if (!enabled_) {
+            return;
+        }
+        const auto now = Clock::now();
+        const auto cpu = cpu_seconds();
+        phases_.push_back(Phase{name, seconds(last_, now), cpu - last_cpu_});
+        last_ = now;
+        last_cpu_ = cpu;
+    }
+
+    // Adds n to the named counter. Counters are printed in order of first
+    // use.
+    void count(const char* const name, const std::size_t n) {
+        if (!enabled_) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& [counter, total] : counters_) {
+            if (std::strcmp(counter, name) == 0) {
+                total += n;
+                return;
+            }
+        }
+        counters_.emplace_back(name, n);
+    }
+
+    // Adds counts of windows indexed, by their length in lines.
+    void windows(const std::vector<std::size_t>& by_length) {
+        if (!enabled_) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (windows_.size() < by_length.size()) {
+            windows_.resize(by_length.size());
+        }
+        for (std::size_t len = 0; len < by_length.size(); ++len) {
+            windows_[len] += by_length[len];
+        }
+    }
+
+    // Records the final state of a hash table, which took the given number
+    // of extra probes to resolve collisions.
+    void table(const std::size_t entries, const std::size_t slots,
+               const std::size_t probes) {
+        if (!enabled_ || slots == 0) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        table_entries_ += entries;
+        table_slots_ += slots;
+        table_probes_ += probes;
+        max_load_ = std::max(max_load_, static_cast<double>(entries) / slots);
+    }
+
+    void print(const std::size_t num_lines) const {
+        if (!enabled_) {
+            return;
+        }
+        const auto total = seconds(start_, last_);
+        for (const auto& phase : phases_) {
+            std::fprintf(stderr, "%-10s %10.3f s %10.3f s cpu\n", phase.name,
+                         phase.wall, phase.cpu);
+        }
+        std::fprintf(stderr, "%-10s %10.3f s %10.3f s cpu\n", "total", total,
+                     last_cpu_ - start_cpu_);
+        std::fprintf(stderr, "%-10s %10zu\n", "lines", num_lines);
+        std::fprintf(stderr, "%-10s %10.0f\n", "lines/s",
+                     total > 0 ? num_lines / total : 0.0);
+        std::size_t num_windows = 0;
+        for (std::size_t len = 0; len < windows_.size(); ++len) {
+            if (windows_[len] != 0) {
+                char name[32];
+                std::snprintf(name, sizeof name, "windows/%zu", len);
+                std::fprintf(stderr, "%-10s %10zu\n", name, windows_[len]);
+                num_windows += windows_[len];
+            }
+        }
+        if (!windows_.empty()) {
+            std::fprintf(stderr, "%-10s %10zu\n", "windows", num_windows);
+        }
+        if (table_slots_ != 0) {
+            std::fprintf(stderr, "%-10s %10.3f (max %.3f)\n", "load",
+                         static_cast<double>(table_entries_) / table_slots_,
+                         max_load_);
+            std::fprintf(stderr, "%-10s %10zu\n", "probes", table_probes_);
+        }
+        for (const auto& [name, n] : counters_) {
+            std::fprintf(stderr, "%-10s %10zu\n", name, n);
+        }
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+        const auto rss = static_cast<double>(usage.ru_maxrss);
+#else
+        const auto rss = static_cast<double>(usage.ru_maxrss) * 1024;
+#endif
+        std::fprintf(stderr, "%-10s %10.1f MiB\n", "peak rss",
+                     rss / (1 << 20));
+    }
+
+   private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Phase {
+        const char* name;
+        double wall;
+        double cpu;
+    };
+
+    static double seconds(const Clock::time_point from,
+                          const Clock::time_point to) {
+        return std::chrono::duration<double>(to - from).count();
+    }
+
+    // User and system time used by all threads.
+    static double cpu_seconds() {
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        const auto time = [](const struct timeval& tv) {
+            return static_cast<double>(tv.tv_sec) + tv.tv_usec / 1e6;
+        };
+        return time(usage.ru_utime) + time(usage.ru_stime);
+    }
+
+    bool enabled_ = false;
+    Clock::time_point start_;
+    Clock::time_point last_;
+    double start_cpu_ = 0;
+    double last_cpu_ = 0;
+    std::vector<Phase> phases_;
+    std::mutex mutex_;
+    std::vector<std::pair<const char*, std::size_t>> counters_;
+    std::vector<std::size_t> windows_;
+    std::size_t table_entries_ = 0;
+    std::size_t table_slots_ = 0;
+    std::size_t table_probes_ = 0;
+    double max_load_ = 0;
+};
+
+Stats STATS;
+
+// =============================================================================
+//       Fingerprint cache
+// =============================================================================
+
+// File of line tables and line hashes from a previous run, keyed by path and
+// file stamp. It is memory-mapped and read in place. All offsets are in bytes
+// from the start of the file, and every array is 8-byte aligned:
+//
+//     Header
+//     Entry[num_entries]
+//     for each entry: std::uint64_t hashes[num_lines]
+//                     Input::Line lines[num_lines]
+//                     char path[path_length], padded to 8 bytes
+class Cache {
+   public:
+    // Entries are only valid for the same normalization flags.
+    Cache(std::string path, const unsigned normalize)
+        : path_(std::move(path)), normalize_(normalize) {
+        const int fd = ::open(path_.c_str(), O_RDONLY);
+        if (fd == -1) {
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size >= off_t{sizeof(Header)}) {
+            size_ = static_cast<std::size_t>(st.st_size);
+            void* const addr =
+                mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr != MAP_FAILED) {
+                data_ = static_cast<const char*>(addr);
+            }
+        }
+        close(fd);
+        if (data_ != nullptr && !load()) {
+            // Ignore a corrupt or outdated cache. It will be overwritten.
+            entries_.clear();
+        }
+    }
+
+    Cache(const Cache&) = delete;
+    Cache& operator=(const Cache&) = delete;
+
+    ~Cache() {
+        if (data_ != nullptr) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+    }
+
+    // Restores the input's lines and hashes if it has not changed. Returns
+    // false if it needs to be read. Safe to call from multiple threads, for
+    // different inputs.
+    bool restore(Input& input) const {
+        const auto it = entries_.find(input.name());
+        if (it == entries_.end()) {
+            return false;
+        }
+        const auto& entry = *it->second;
+        if (!(entry.stamp == input.stamp())) {
+            return false;
+        }
+        const auto* hashes =
+            reinterpret_cast<const std::uint64_t*>(data_ + entry.data_offset);
+        const auto* lines =
+            reinterpret_cast<const Input::Line*>(hashes + entry.num_lines);
+        input.restore(lines, hashes, entry.num_lines);
+        ++hits_;
+        return true;
+    }
+
+    // Whether every input was restored, so the cache is already up to date.
+    bool fresh(const std::vector<Input>& inputs) const {
+        return hits_ == inputs.size() && entries_.size() == inputs.size();
+    }
+
+    // Atomically replaces the cache file with entries for the given inputs,
+    // which must all have hashes.
+    void save(const std::vector<Input>& inputs) const {
+        std::vector<Entry> entries;
+        auto offset = sizeof(Header) + inputs.size() * sizeof(Entry);
+        for (const auto& input : inputs) {
+            const auto num_lines = input.end();
+            const auto path_length = std::strlen(input.name());
+            entries.push_back(Entry{input.stamp(), num_lines, offset,
+                                    offset + num_lines * LINE_BYTES,
+                                    path_length});
+            offset += num_lines * LINE_BYTES + padded(path_length);
+        }
+        auto tmp = path_ + ".XXXXXX";
+        const int fd = mkstemp(tmp.data());
+        if (fd == -1) {
+            fail("%s: %s", tmp.c_str(), std::strerror(errno));
+        }
+        FILE* const file = fdopen(fd, "wb");
+        // Leave the old cache in place if anything fails.
+        const auto check = [&](const bool ok, const std::string& path) {
+            if (!ok) {
+                const int err = errno;
+                unlink(tmp.c_str());
+                fail("%s: %s", path.c_str(), std::strerror(err));
+            }
+        };
+        check(file != nullptr, tmp);
+        const auto write = [&](const void* const data, const std::size_t size,
+                               const std::size_t count) {
+            check(std::fwrite(data, size, count, file) == count, tmp);
+        };
+        const Header header{{'D', 'U', 'P', 'L', 'I', 'N', 'E', 'S'},
+                            VERSION, normalize_, entries.size()};
+        write(&header, sizeof header, 1);
+        write(entries.data(), sizeof(Entry), entries.size());
+        const char zeros[8] = {};
+        for (const auto& input : inputs) {
+            const auto num_lines = input.end();
+            const auto path_length = std::strlen(input.name());
+            write(input.hashes(), sizeof(std::uint64_t), num_lines);
+            write(input.lines(), sizeof(Input::Line), num_lines);
+            write(input.name(), 1, path_length);
+            write(zeros, 1, padded(path_length) - path_length);
+        }
+        check(std::fflush(file) == 0 && fsync(fd) == 0, tmp);
+        check(std::fclose(file) == 0, tmp);
+        check(rename(tmp.c_str(), path_.c_str()) == 0, path_);
+    }
+
+   private:
+    static constexpr std::uint32_t VERSION = 2;
+    static constexpr std::size_t LINE_BYTES =
+        sizeof(std::uint64_t) + sizeof(Input::Line);
+
+    struct Header {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t normalize;
+        std::uint64_t num_entries;
+    };
+
+    struct Entry {
+        FileStamp stamp;
+        std::uint64_t num_lines;
+        std::uint64_t data_offset;
+        std::uint64_t path_offset;
+        std::uint64_t path_length;
+    };
+
+    static_assert(sizeof(Input::Line) == 16, "unexpected Line layout");
+
+    static std::size_t padded(const std::size_t n) { return (n + 7) & ~7; }
+
+    bool load() {
+        Header header;
+        std::memcpy(&header, data_, sizeof header);
+        if (std::memcmp(header.magic, "DUPLINES", 8) != 0 ||
+            header.version != VERSION || header.normalize != normalize_ ||
+            header.num_entries > (size_ - sizeof header) / sizeof(Entry)) {
+            return false;
+        }
+        const auto* entries =
+            reinterpret_cast<const Entry*>(data_ + sizeof header);
+        for (std::uint64_t i = 0; i < header.num_entries; ++i) {
+            const auto& entry = entries[i];
+            if (entry.num_lines > size_ / LINE_BYTES ||
+                entry.data_offset > size_ - entry.num_lines * LINE_BYTES ||
+                entry.data_offset % 8 != 0 || entry.path_offset > size_ ||
+                entry.path_length > size_ - entry.path_offset) {
+                return false;
+            }
+            const std::string_view path(data_ + entry.path_offset,
+                                        entry.path_length);
+            entries_.emplace(path, &entry);
+        }
+        return true;
+    }
+
+    std::string path_;
+    unsigned normalize_;
+    const char* data_ = nullptr;
+    std::size_t size_ = 0;
+    std::unordered_map<std::string_view, const Entry*> entries_;
+    mutable std::atomic<std::size_t> hits_ = 0;
+};
+
+// =============================================================================
+//       Directory walking
+// =============================================================================
+
+// Matches text against a glob with the syntax of .gitignore: "*" and "?"
+// match anything but "/", "**" matches across directories, "[...]" is a
+// character class, and "\" escapes the next character.
+bool glob(const std::string_view pattern, const std::string_view text) {
+    const auto n = pattern.size();
+    std::size_t p = 0;
+    std::size_t t = 0;
+    while (p < n) {
+        if (pattern[p] == '*') {
+            if (p + 1 < n && pattern[p + 1] == '*') {
+                p += 2;
+                // A "**/" matches zero or more whole directories.
+                const bool dirs = p < n && pattern[p] == '/';
+                const auto rest = pattern.substr(dirs ? p + 1 : p);
+                for (auto i = t; i <= text.size(); ++i) {
+                    if ((!dirs || i == t || text[i - 1] == '/') &&
+                        glob(rest, text.substr(i))) {
+                        return true;
+                    }
+                }
+                return false;
+            }
+            const auto rest = pattern.substr(p + 1);
+            for (auto i = t;; ++i) {
+                if (glob(rest, text.substr(i))) {
+                    return true;
+                }
+                if (i == text.size() || text[i] == '/') {
+                    return false;
+                }
+            }
+        }
+        if (t == text.size()) {
+            return false;
+        }
+        const char c = text[t];
+        if (pattern[p] == '?' && c != '/') {
+            ++p;
+            ++t;
+            continue;
+        }
+        if (pattern[p] == '[') {
+            auto q = p + 1;
+            const bool negate =
+                q < n && (pattern[q] == '!' || pattern[q] == '^');
+            q += negate;
+            const auto first = q;
+            bool match = false;
+            for (; q < n && (q == first || pattern[q] != ']'); ++q) {
+                auto lo = pattern[q];
+                auto hi = lo;
+                if (q + 2 < n && pattern[q + 1] == '-' &&
+                    pattern[q + 2] != ']') {
+                    hi = pattern[q + 2];
+                    q += 2;
+                }
+                match |= lo <= c && c <= hi;
+            }
+            if (q < n) {
+                if (match == negate || c == '/') {
+                    return false;
+                }
+                p = q + 1;
+                ++t;
+                continue;
+            }
+            // Without a closing bracket, "[" is literal.
+        }
+        if (pattern[p] == '\\' && p + 1 < n) {
+            ++p;
+        }
+        if (pattern[p] != c) {
+            return false;
+        }
+        ++p;
+        ++t;
+    }
+    return t == text.size();
+}
+
+// Patterns from one .gitignore file (or from --exclude), which apply to paths
+// under its directory. Rules from deeper directories take precedence.
+struct IgnoreList {
+    struct Rule {
+        std::string pattern;
+        bool negate;
+        // Only matches directories (pattern ended in "/").
+        bool dir_only;
+        // Matches the path relative to the base, not just the basename.
+        bool anchored;
+    };
+
+    std::shared_ptr<const IgnoreList> parent;
+    std::string base;
+    std::vector<Rule> rules;
+
+    void add(std::string_view line) {
+        while (!line.empty() && (line.back() == '\r' || line.back() == ' ')) {
+            line.remove_suffix(1);
+        }
+        if (line.empty() || line[0] == '#') {
+            return;
+        }
+        Rule rule{};
+        if (line[0] == '!') {
+            rule.negate = true;
+            line.remove_prefix(1);
+        }
+        if (!line.empty() && line.back() == '/') {
+            rule.dir_only = true;
+            line.remove_suffix(1);
+        }
+        rule.anchored = line.find('/') != std::string_view::npos;
+        if (!line.empty() && line[0] == '/') {
+            line.remove_prefix(1);
+        }
+        if (!line.empty()) {
+            rule.pattern = line;
+            rules.push_back(std::move(rule));
+        }
+    }
+
+    // Whether a path under base is ignored by this list or its ancestors.
+    static bool ignored(const IgnoreList* list, const std::string& path,
+                        const bool is_dir) {
+        const auto slash = path.rfind('/');
+        const auto basename = std::string_view(path).substr(slash + 1);
+        for (; list != nullptr; list = list->parent.get()) {
+            const auto relative =
+                std::string_view(path).substr(list->base.size() + 1);
+            for (auto it = list->rules.rbegin(); it != list->rules.rend();
+                 ++it) {
+                if (it->dir_only && !is_dir) {
+                    continue;
+                }
+                if (glob(it->pattern, it->anchored ? relative : basename)) {
+                    return !it->negate;
+                }
+            }
+        }
+        return false;
+    }
+};
+
+// Files with a NUL in this many bytes at the start are skipped as binary.
+constexpr std::size_t SNIFF_BYTES = 8192;
+
+// Walks directories on the thread pool, opening each text file it finds and
+// handing it to a callback while the walk continues. Files are kept in a
+// deque so that they do not move while other tasks use them.
+class Walker {
+   public:
+    using Visit = std::function<void(Input&)>;
+
+    Walker(ThreadPool& pool, Visit visit)
+        : pool_(pool), visit_(std::move(visit)) {}
+
+    // Starts walking the directories. Call finish() after the pool is idle.
+    void start(const Options& options) {
+        for (const char* const dir : options.dirs) {
+            std::string root(dir);
+            while (root.size() > 1 && root.back() == '/') {
+                root.pop_back();
+            }
+            auto excludes = std::make_shared<IgnoreList>();
+            excludes->base = root == "/" ? "" : root;
+            for (const char* const pattern : options.excludes) {
+                excludes->add(pattern);
+            }
+            pool_.submit([this, excludes] {
+                walk(excludes->base, nullptr, excludes);
+            });
+        }
+    }
+
+    // Moves the files found to the end of inputs, sorted by path so that the
+    // output does not depend on the order in which they were found.
+    void finish(std::vector<Input>& inputs) {
+        std::vector<Input*> sorted;
+        for (auto& input : found_) {
+            sorted.push_back(&input);
+        }
+        std::sort(sorted.begin(), sorted.end(), [](auto* a, auto* b) {
+            return std::strcmp(a->name(), b->name()) < 0;
+        });
+        inputs.reserve(inputs.size() + sorted.size());
+        for (auto* input : sorted) {
+            inputs.push_back(std::move(*input));
+        }
+        found_.clear();
+    }
+
+   private:
+    // Whether to skip a path, checking the --exclude patterns after the
+    // .gitignore files so that a negated .gitignore pattern cannot re-include
+    // an excluded path.
+    static bool skipped(const IgnoreList* ignores, const IgnoreList* excludes,
+                        const std::string& path, const bool is_dir) {
+        return IgnoreList::ignored(ignores, path, is_dir) ||
+               IgnoreList::ignored(excludes, path, is_dir);
+    }
+
+    void walk(std::string dir, std::shared_ptr<const IgnoreList> ignores,
+              std::shared_ptr<const IgnoreList> excludes) {
+        const auto gitignore = dir + "/.gitignore";
+        if (FILE* const file = std::fopen(gitignore.c_str(), "r")) {
+            auto list = std::make_shared<IgnoreList>();
+            list->parent = std::move(ignores);
+            list->base = dir;
+            char* line = nullptr;
+            std::size_t capacity = 0;
+            ssize_t length;
+            while ((length = ::getline(&line, &capacity, file)) > 0) {
+                if (line[length - 1] == '\n') {
+                    --length;
+                }
+                list->add(std::string_view(line, length));
+            }
+            std::free(line);
+            std::fclose(file);
+            ignores = std::move(list);
+        }
+        DIR* const handle = opendir(dir.empty() ? "/" : dir.c_str());
+        if (handle == nullptr) {
+            std::fprintf(stderr, "%s: %s: %s\n", PROGRAM, dir.c_str(),
+                         std::strerror(errno));
+            return;
+        }
+        while (const dirent* const entry = readdir(handle)) {
+            const char* const name = entry->d_name;
+            if (std::strcmp(name, ".") == 0 || std::strcmp(name, "..") == 0 ||
+                std::strcmp(name, ".git") == 0) {
+                continue;
+            }
+            auto path = dir + "/" + name;
+            auto type = entry->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+                if (lstat(path.c_str(), &st) == -1) {
+                    continue;
+                }
+                type = S_ISDIR(st.st_mode)   ? DT_DIR
+                       : S_ISREG(st.st_mode) ? DT_REG
+                                             : DT_UNKNOWN;
+            }
+            // Like git, do not follow symbolic links.
+            if (type == DT_DIR) {
+                if (!skipped(ignores.get(), excludes.get(), path, true)) {
+                    pool_.submit(
+                        [this, path = std::move(path), ignores, excludes] {
+                            walk(path, ignores, excludes);
+                        });
+                }
+            } else if (type == DT_REG) {
+                if (!skipped(ignores.get(), excludes.get(), path, false)) {
+                    add(std::move(path));
+                }
+            }
+        }
+        closedir(handle);
+    }
+
+    void add(std::string path) {
+        Input input(std::move(path));
+        // Skip unreadable files like binary ones, rather than exiting from a
+        // worker thread in the middle of the walk.
+        if (!input.open()) {
+            std::fprintf(stderr, "%s: %s: %s\n", PROGRAM, input.name(),
+                         std::strerror(errno));
+            return;
+        }
+        if (input.binary(SNIFF_BYTES)) {
+            return;
+        }
+        Input* stored;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stored = &found_.emplace_back(std::move(input));
+        }
+        visit_(*stored);
+    }
+
+    ThreadPool& pool_;
+    Visit visit_;
+    std::mutex mutex_;
+    std::deque<Input> found_;
+};
+
+// =============================================================================
+//       Git revisions
+// =============================================================================
+
+// Adds an input for each distinct text blob in the given revisions of the git
+// repository in the current directory, limited to the given paths if any.
+// Blobs are read through one git cat-file process. Each is read once, however
+// many revisions or paths share it, and named REV:PATH after the first.
+void add_revisions(const std::vector<const char*>& revs,
+                   const std::vector<const char*>& paths,
+                   std::vector<Input>& inputs) {
+    struct Blob {
+        std::string oid;
+        std::string name;
+    };
+    std::vector<Blob> blobs;
+    std::unordered_set<std::string> seen;
+    for (const char* const rev : revs) {
+        std::vector<std::string> args{"git", "ls-tree", "-r", "-z", rev, "--"};
+        args.insert(args.end(), paths.begin(), paths.end());
+        Child ls_tree(args);
+        std::string listing;
+        if (!read_all(ls_tree.out(), listing) || !ls_tree.wait()) {
+            fail("%s: cannot list files", rev);
+        }
+        // Each entry is "MODE TYPE OID\tPATH\0". Skip symlinks, which are
+        // blobs with mode 120000, and submodules.
+        std::size_t pos = 0;
+        while (pos < listing.size()) {
+            auto end = listing.find('\0', pos);
+            if (end == std::string::npos) {
+                end = listing.size();
+            }
+            const std::string_view entry(listing.data() + pos, end - pos);
+            pos = end + 1;
+            const auto tab = entry.find('\t');
+            const auto meta = entry.substr(0, tab);
+            if (tab == std::string_view::npos ||
+                meta.substr(0, 7) == "120000 " ||
+                meta.find(" blob ") == std::string_view::npos) {
+                continue;
+            }
+            std::string oid(meta.substr(meta.rfind(' ') + 1));
+            if (seen.insert(oid).second) {
+                blobs.push_back(Blob{std::move(oid),
+                                     std::string(rev) + ":" +
+                                         std::string(entry.substr(tab + 1))});
+            }
+        }
+    }
+
+    Child cat_file({"git", "cat-file", "--batch"}, true);
+    FILE* const requests = fdopen(dup(cat_file.in()), "w");
+    FILE* const responses = fdopen(dup(cat_file.out()), "r");
+    std::string text;
+    for (const auto& blob : blobs) {
+        std::fprintf(requests, "%s\n", blob.oid.c_str());
+        std::fflush(requests);
+        // The response is "OID TYPE SIZE\n", then the contents and "\n".
+        char header[256];
+        std::size_t size;
+        if (std::fgets(header, sizeof header, responses) == nullptr ||
+            std::sscanf(header, "%*s blob %zu", &size) != 1) {
+            fail("%s: cannot read blob", blob.name.c_str());
+        }
+        text.resize(size);
+        if (std::fread(text.data(), 1, size, responses) != size ||
+            std::fgetc(responses) != '\n') {
+            fail("%s: cannot read blob", blob.name.c_str());
+        }
+        Input input(blob.name);
+        input.assign(text);
+        if (!input.binary(SNIFF_BYTES)) {
+            inputs.push_back(std::move(input));
+        }
+    }
+    std::fclose(requests);
+    std::fclose(responses);
+    if (!cat_file.wait()) {
+        fail("git cat-file failed");
+    }
+}
+
+// =============================================================================
+//       Line interning
+// =============================================================================
+
+// Bump allocator for strings that live as long as the arena.
+class Arena {
+   public:
+    std::string_view copy(const std::string_view s) {
+        if (s.size() > left_) {
+            const auto size = std::max(BLOCK_SIZE, s.size());
+            blocks_.push_back(std::make_unique<char[]>(size));
+            next_ = blocks_.back().get();
+            left_ = size;
+        }
+        std::memcpy(next_, s.data(), s.size());
+        const std::string_view result(next_, s.size());
+        next_ += s.size();
+        left_ -= s.size();
+        return result;
+    }
+
+   private:
+    static constexpr std::size_t BLOCK_SIZE = 1 << 20;
+
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    char* next_ = nullptr;
+    std::size_t left_ = 0;
+};
+
+// Assigns dense IDs to distinct lines, copying the text of each into an arena
+// and remembering its hash. With normalization, lines that are equal after
+// normalizing share an ID, and text() is the first one seen. Safe to call
+// intern() from multiple threads.
+class Interner {
+   public:
+    explicit Interner(const unsigned normalize) : normalize_(normalize) {}
+
+    LineId intern(const std::string_view line) {
+        return intern(line, hash_line(line, normalize_));
+    }
+
+    LineId intern(const std::string_view line, const std::uint64_t hash) {
+        auto& shard = shards_[hash % NUM_SHARDS];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if ((shard.size + 1) * 2 > shard.slots.size()) {
+            grow(shard);
+        }
+        auto& slot = find(shard, line, hash, normalize_);
+        if (slot.id == EMPTY) {
+            slot = Entry{hash, shard.arena.copy(line), next_id_++};
+            ++shard.size;
+        }
+        return slot.id;
+    }
+
+    std::size_t size() const { return next_id_; }
+
+    // Makes hash() and text() available. Call after interning everything.
+    void finish() {
+        entries_.resize(size());
+        for (const auto& shard : shards_) {
+            for (const auto& entry : shard.slots) {
+                if (entry.id != EMPTY) {
+                    entries_[entry.id] = entry;
+                }
+            }
+        }
+    }
+
+    std::uint64_t hash(const LineId id) const { return entries_[id].hash; }
+    std::string_view text(const LineId id) const { return entries_[id].text; }
+
+   private:
+    static constexpr std::size_t NUM_SHARDS = 64;
+    static constexpr auto EMPTY = std::numeric_limits<LineId>::max();
+
+    struct Entry {
+        std::uint64_t hash;
+        std::string_view text;
+        LineId id = EMPTY;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::vector<Entry> slots;
+        std::size_t size = 0;
+        Arena arena;
+    };
+
+    static Entry& find(Shard& shard, const std::string_view line,
+                       const std::uint64_t hash, const unsigned normalize) {
+        const auto mask = shard.slots.size() - 1;
+        // Use high bits, since the low bits picked the shard.
+        auto i = static_cast<std::size_t>(hash >> 20) & mask;
+        for (;; i = (i + 1) & mask) {
+            auto& entry = shard.slots[i];
+            if (entry.id == EMPTY ||
+                (entry.hash == hash &&
+                 same_text(entry.text, line, normalize))) {
+                return entry;
+            }
+        }
+    }
+
+    static void grow(Shard& shard) {
+        auto old = std::move(shard.slots);
+        shard.slots.assign(std::max<std::size_t>(1024, old.size() * 2),
+                           Entry{});
+        for (const auto& entry : old) {
+            if (entry.id != EMPTY) {
+                // Entries are distinct even after normalization, so
+                // comparing exactly is enough.
+                find(shard, entry.text, entry.hash, 0) = entry;
+            }
+        }
+    }
+
+    unsigned normalize_;
+    Shard shards_[NUM_SHARDS];
+    std::atomic<LineId> next_id_{0};
+    std::vector<Entry> entries_;
+};
+
+// Returns true if the ID sequences are equal, comparing four at a time.
+bool equal_ids(const LineId* a, const LineId* b, std::size_t n) {
+#if defined(__SSE2__)
+    for (; n >= 4; a += 4, b += 4, n -= 4) {
+        const auto x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a));
+        const auto y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(x, y)) != 0xffff) {
+            return false;
+        }
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for (; n >= 4; a += 4, b += 4, n -= 4) {
+        if (vminvq_u32(vceqq_u32(vld1q_u32(a), vld1q_u32(b))) == 0) {
+            return false;
+        }
+    }
+#endif
+    for (; n > 0; ++a, ++b, --n) {
+        if (*a != *b) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Returns true if the two ranges have identical lines. Requires interning.
+bool same_lines(const LineRange& a, const LineRange& b) {
+    const auto len = a.end - a.start;
+    return b.end - b.start == len &&
+           equal_ids(a.input->ids() + a.start, b.input->ids() + b.start, len);
+}
+
+// Number of lines handled by a single task.
+constexpr LineNo CHUNK_LINES = 1 << 14;
+
+// Calls f(first, last) for each chunk of lines. Lines are split into chunks so
+// that other workers can steal part of a large file.
+template <typename F>
+void for_each_chunk(const LineNo num_lines, F f) {
+    for (LineNo first = 0; first < num_lines; first += CHUNK_LINES) {
+        f(first, std::min(num_lines, first + CHUNK_LINES));
+    }
+}
+
+// Reads and interns every input in parallel, along with the files found in
+// options.dirs, which are appended to inputs. Found files are read as soon as
+// they are discovered. With options.cache, unchanged inputs are restored from
+// the cache instead of being read and hashed, and the cache is updated
+// afterwards. If given, ready is called with each input as soon as all its
+// lines are interned, and then with nullptr before found files are moved into
+// inputs, after which the pointers it was given are no longer valid.
+void ingest(ThreadPool& pool, std::vector<Input>& inputs, Interner& interner,
+            const Options& options,
+            const std::function<void(const Input*)>& ready = nullptr) {
+    std::optional<Cache> cache_storage;
+    if (options.cache != nullptr) {
+        cache_storage.emplace(options.cache, options.normalize);
+    }
+    const Cache* const cache = cache_storage ? &*cache_storage : nullptr;
+    const auto normalize = options.normalize;
+    const auto start = [&pool, &interner, cache, normalize,
+                        &ready](Input& input) {
+        pool.submit([&pool, &input, &interner, cache, normalize, &ready] {
+            if (cache != nullptr) {
+                if (!cache->restore(input)) {
+                    input.read();
+                    input.reserve_hashes();
+                }
+            } else {
+                input.read();
+            }
+            // Chunks left to intern, counted only when someone is waiting.
+            std::shared_ptr<std::atomic<LineNo>> left;
+            if (ready) {
+                if (input.end() == 0) {
+                    ready(&input);
+                    return;
+                }
+                left = std::make_shared<std::atomic<LineNo>>(
+                    (input.end() + CHUNK_LINES - 1) / CHUNK_LINES);
+            }
+            for_each_chunk(input.end(), [&](LineNo first, LineNo last) {
+                pool.submit([&input, &interner, first, last, cache,
+                             normalize, &ready, left] {
+                    auto* ids = input.ids();
+                    auto* hashes = input.hashes();
+                    for (auto i = first; i < last; ++i) {
+                        if (cache == nullptr) {
+                            ids[i] = interner.intern(input.get(i));
+                            continue;
+                        }
+                        if (hashes[i] == 0) {
+                            hashes[i] = hash_line(input.get(i), normalize);
+                        }
+                        ids[i] = interner.intern(input.get(i), hashes[i]);
+                    }
+                    if (left && --*left == 0) {
+                        ready(&input);
+                    }
+                });
+            });
+        });
+    };
+    for (auto& input : inputs) {
+        start(input);
+    }
+    Walker walker(pool, start);
+    walker.start(options);
+    pool.wait();
+    if (ready) {
+        ready(nullptr);
+    }
+    walker.finish(inputs);
+    interner.finish();
+    if (cache != nullptr && !cache->fresh(inputs)) {
+        cache->save(inputs);
+    }
+}
+
+// =============================================================================
+//       Reporting
+// =============================================================================
+
+// Buffered writer for a file descriptor. Data is collected in a large buffer
+// and written with a single write(2). Strings too big to buffer are written
+// together with the buffer using writev(2), without copying. Write errors are
+// fatal unless the writer is for a client of --serve, in which case the rest
+// of the output is discarded.
+class Writer {
+   public:
+    explicit Writer(const int fd, const bool fatal = true)
+        : fd_(fd), fatal_(fatal), buf_(new char[CAPACITY]) {}
+
+    Writer(const Writer&) = delete;
+    Writer& operator=(const Writer&) = delete;
+
+    ~Writer() { flush(); }
+
+    void put(const char c) {
+        if (size_ == CAPACITY) {
+            flush();
+        }
+        buf_[size_++] = c;
+    }
+
+    void put(const std::string_view s) {
+        if (s.size() <= CAPACITY - size_) {
+            std::memcpy(buf_.get() + size_, s.data(), s.size());
+            size_ += s.size();
+            return;
+        }
+        if (s.size() < CAPACITY / 2) {
+            flush();
+            put(s);
+            return;
+        }
+        struct iovec iov[2] = {{buf_.get(), size_},
+                               {const_cast<char*>(s.data()), s.size()}};
+        write_all(iov, 2);
+        size_ = 0;
+    }
+
+    void put_number(std::size_t n) {
+        char digits[20];
+        std::size_t i = sizeof digits;
+        do {
+            digits[--i] = static_cast<char>('0' + n % 10);
+            n /= 10;
+        } while (n != 0);
+        put(std::string_view(digits + i, sizeof digits - i));
+    }
+
+    void flush() {
+        if (size_ != 0) {
+            struct iovec iov = {buf_.get(), size_};
+            write_all(&iov, 1);
+            size_ = 0;
+        }
+    }
+
+   private:
+    static constexpr std::size_t CAPACITY = 1 << 20;
+
+    void write_all(struct iovec* iov, int count) {
+        while (count > 0 && !broken_) {
+            const auto n = writev(fd_, iov, count);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (fatal_) {
+                    fail("write error: %s", std::strerror(errno));
+                }
+                broken_ = true;
+                break;
+            }
+            auto written = static_cast<std::size_t>(n);
+            for (; count > 0 && written >= iov->iov_len; ++iov, --count) {
+                written -= iov->iov_len;
+            }
+            if (count > 0) {
+                iov->iov_base = static_cast<char*>(iov->iov_base) + written;
+                iov->iov_len -= written;
+            }
+        }
+    }
+
+    int fd_;
+    bool fatal_;
+    bool broken_ = false;
+    std::unique_ptr<char[]> buf_;
+    std::size_t size_ = 0;
+};
+
+// Returns the length of the UTF-8 sequence at the start of s, or 0 if it is
+// invalid (including overlong encodings and surrogates).
+std::size_t utf8_length(const std::string_view s) {
+    const auto byte = [&](std::size_t i) {
+        return i < s.size() ? static_cast<unsigned char>(s[i]) : 0u;
+    };
+    const auto c = byte(0);
+    std::size_t n;
+    unsigned lo = 0x80;
+    unsigned hi = 0xbf;
+    if (c >= 0xc2 && c <= 0xdf) {
+        n = 2;
+    } else if (c >= 0xe0 && c <= 0xef) {
+        n = 3;
+        lo = c == 0xe0 ? 0xa0 : lo;
+        hi = c == 0xed ? 0x9f : hi;
+    } else if (c >= 0xf0 && c <= 0xf4) {
+        n = 4;
+        lo = c == 0xf0 ? 0x90 : lo;
+        hi = c == 0xf4 ? 0x8f : hi;
+    } else {
+        return 0;
+    }
+    if (byte(1) < lo || byte(1) > hi) {
+        return 0;
+    }
+    for (std::size_t i = 2; i < n; ++i) {
+        if (byte(i) < 0x80 || byte(i) > 0xbf) {
+            return 0;
+        }
+    }
+    return n;
+}
+
+// Writes s as a JSON string. Invalid UTF-8 is replaced with U+FFFD.
+void put_json(Writer& out, const std::string_view s) {
+    static const char HEX[] = "0123456789abcdef";
+    out.put('"');
+    std::size_t i = 0;
+    while (i < s.size()) {
+        // Copy runs of characters that need no escaping at once.
+        auto j = i;
+        while (j < s.size()) {
+            const auto c = static_cast<unsigned char>(s[j]);
+            if (c < 0x20 || c == '"' || c == '\\' || c >= 0x80) {
+                break;
+            }
+            ++j;
+        }
+        out.put(s.substr(i, j - i));
+        if (j == s.size()) {
+            break;
+        }
+        i = j;
+        const auto c = static_cast<unsigned char>(s[i]);
+        if (c >= 0x80) {
+            const auto n = utf8_length(s.substr(i));
+            if (n == 0) {
+                out.put("\\ufffd");
+                ++i;
+            } else {
+                out.put(s.substr(i, n));
+                i += n;
+            }
+            continue;
+        }
+        out.put('\\');
+        switch (c) {
+        case '"':
+        case '\\':
+            out.put(static_cast<char>(c));
+            break;
+        case '\n':
+            out.put('n');
+            break;
+        case '\t':
+            out.put('t');
+            break;
+        case '\r':
+            out.put('r');
+            break;
+        default:
+            out.put("u00");
+            out.put(HEX[c >> 4]);
+            out.put(HEX[c & 0xf]);
+            break;
+        }
+        ++i;
+    }
+    out.put('"');
+}
+
+// Prints sets of duplicate ranges, skipping any that overlap a set that was
+// already printed. Callers should report the largest duplicates first.
+class Reporter {
+   public:
+    // Prints to standard output, or to a client of --serve if given.
+    Reporter(const std::vector<Input>& inputs, const Options& options,
+             const int client = -1)
+        : format_(options.format),
+          snippet_(options.snippet),
+          top_(static_cast<std::size_t>(options.top)),
+          out_(client == -1 ? STDOUT_FILENO : client, client == -1) {
+        for (const auto& input : inputs) {
+            const auto num_lines = input.end();
+            taken_.emplace(&input, num_lines);
+        }
+    }
+
+    // Reports a set of ranges of equal length and content.
+    void report(const std::vector<LineRange>& ranges) {
+        if (!claim(ranges)) {
+            return;
+        }
+        if (skip_ && skip_(ranges)) {
+            return;
+        }
+        const auto first_range = ranges.front();
+        lines_.clear();
+        for (auto i = first_range.start; i < first_range.end; ++i) {
+            lines_.push_back(first_range.input->get(i));
+        }
+        print(ranges, lines_);
+    }
+
+    // Reports ranges that are similar but not necessarily equal, printing the
+    // lines of the first one. Each range differs by at most edits line edits
+    // from the range in the set it was matched with.
+    void report_near(const std::vector<LineRange>& ranges,
+                     const std::size_t edits) {
+        const auto first_range = ranges.front();
+        lines_.clear();
+        for (auto i = first_range.start; i < first_range.end; ++i) {
+            lines_.push_back(first_range.input->get(i));
+        }
+        print(ranges, lines_, edits);
+    }
+
+    // Writes out everything printed so far.
+    void flush() { out_.flush(); }
+
+    // Calls f with each set printed from now on.
+    void on_print(std::function<void(const std::vector<LineRange>&)> f) {
+        on_print_ = std::move(f);
+    }
+
+    // Claims but does not print reported sets for which f returns true.
+    void skip_if(std::function<bool(const std::vector<LineRange>&)> f) {
+        skip_ = std::move(f);
+    }
+
+    // Returns true once -k sets have been printed, after which engines should
+    // stop reporting.
+    bool done() const { return top_ != 0 && printed_ >= top_; }
+
+    // Returns true if claim() would certainly fail, because the first line of
+    // every range was already reported.
+    bool covered(const std::vector<LineRange>& ranges) {
+        for (const auto range : ranges) {
+            if (!taken_[range.input][range.start]) {
+                return false;
+            }
+        }
+        STATS.count("suppressed", 1);
+        return true;
+    }
+
+    // Marks the ranges as reported. Returns false if any of their lines were
+    // already reported, in which case the set should not be printed.
+    bool claim(const std::vector<LineRange>& ranges) {
+        for (const auto range : ranges) {
+            auto& bitmap = taken_[range.input];
+            for (auto i = range.start; i < range.end; ++i) {
+                if (bitmap[i]) {
+                    // Very conservative: never report another duplicate in
+                    // which even one line of one copy has already been reported
+                    // as part of another set of duplicates.
+                    STATS.count("suppressed", 1);
+                    return false;
+                }
+                bitmap[i] = true;
+            }
+        }
+        return true;
+    }
+
+    // Prints a set of ranges whose lines are given separately. For near
+    // duplicates, edits is the most line edits between two matched ranges,
+    // which may then differ in length.
+    template <typename Lines>
+    void print(const std::vector<LineRange>& ranges, const Lines& lines,
+               const std::optional<std::size_t> edits = std::nullopt) {
+        ++printed_;
+        STATS.count("sets", 1);
+        if (on_print_) {
+            on_print_(ranges);
+        }
+        switch (format_) {
+        case Format::Text:
+            print_text(ranges, lines, edits);
+            break;
+        case Format::Jsonl:
+            print_jsonl(ranges, lines, edits);
+            break;
+        }
+    }
+
+   private:
+    template <typename Lines>
+    void print_text(const std::vector<LineRange>& ranges, const Lines& lines,
+                    const std::optional<std::size_t> edits) {
+        for (const auto range : ranges) {
+            out_.put(range.input->name());
+            out_.put(':');
+            out_.put_number(range.start + 1);
+            if (edits) {
+                out_.put('-');
+                out_.put_number(range.end);
+            }
+            out_.put('\n');
+        }
+        if (edits) {
+            out_.put("edits: ");
+            out_.put_number(*edits);
+            out_.put('\n');
+        }
+        if (snippet_) {
+            out_.put('\n');
+            for (const std::string_view line : lines) {
+                out_.put("> ");
+                out_.put(line);
+                out_.put('\n');
+            }
+        }
+        out_.put("\n\n");
+    }
+
+    // Prints one JSON object per line, like
+    // {"length":2,"locations":[{"file":"a","line":1},...],"lines":["x","y"]}
+    // Near duplicates also have "edits", and "end" in each location.
+    template <typename Lines>
+    void print_jsonl(const std::vector<LineRange>& ranges, const Lines& lines,
+                     const std::optional<std::size_t> edits) {
+        out_.put("{\"length\":");
+        out_.put_number(ranges.front().end - ranges.front().start);
+        if (edits) {
+            out_.put(",\"edits\":");
+            out_.put_number(*edits);
+        }
+        out_.put(",\"locations\":[");
+        for (std::size_t i = 0; i < ranges.size(); ++i) {
+            out_.put(i == 0 ? "{\"file\":" : ",{\"file\":");
+            put_json(out_, ranges[i].input->name());
+            out_.put(",\"line\":");
+            out_.put_number(ranges[i].start + 1);
+            if (edits) {
+                out_.put(",\"end\":");
+                out_.put_number(ranges[i].end);
+            }
+            out_.put('}');
+        }
+        out_.put(']');
+        if (snippet_) {
+            out_.put(",\"lines\":[");
+            bool first = true;
+            for (const std::string_view line : lines) {
+                if (!first) {
+                    out_.put(',');
+                }
+                first = false;
+                put_json(out_, line);
+            }
+            out_.put(']');
+        }
+        out_.put("}\n");
+    }
+
+    Format format_;
+    bool snippet_;
+    std::size_t top_;
+    std::size_t printed_ = 0;
+    Writer out_;
+    std::unordered_map<const Input*, std::vector<bool>> taken_;
+    std::vector<std::string_view> lines_;
+    std::function<void(const std::vector<LineRange>&)> on_print_;
+    std::function<bool(const std::vector<LineRange>&)> skip_;
+};
+
+// Finds duplicates of the windows of min lines in input that start where
+// wanted, growing each as far as the lines are equal in both directions. For
+// each start s, candidates(s, f) must call f(other, t) for every window at t
+// in other (possibly input itself) with the same fingerprint. Each duplicate
+// is passed to found(other, a, b, size), for size lines at a in input and at b
+// in other.
+template <typename Candidates, typename Found>
+void find_matches(const Input& input, const std::vector<bool>& wanted,
+                  const std::size_t min, const unsigned normalize,
+                  Candidates candidates, Found found) {
+    const auto n = input.end();
+    // Where each diagonal (other input and offset) was last matched up to, to
+    // skip windows inside matches already reported.
+    std::map<std::pair<const Input*, std::int64_t>, LineNo> reached;
+    const auto match = [&](const Input* const other, const LineNo s,
+                           const LineNo t) {
+        if (other == &input && t == s) {
+            return;
+        }
+        const auto diagonal =
+            static_cast<std::int64_t>(t) - static_cast<std::int64_t>(s);
+        auto& end = reached[{other, diagonal}];
+        if (s < end) {
+            return;
+        }
+        const auto same = [&](const LineNo x, const LineNo y) {
+            return same_text(input.get(x), other->get(y), normalize);
+        };
+        LineNo len = 0;
+        while (len < min && t + len < other->end() &&
+               same(s + len, t + len)) {
+            ++len;
+        }
+        if (len < min) {
+            return;
+        }
+        auto a = s;
+        auto b = t;
+        while (a > end && b > 0 && same(a - 1, b - 1)) {
+            --a;
+            --b;
+        }
+        while (s + len < n && t + len < other->end() &&
+               same(s + len, t + len)) {
+            ++len;
+        }
+        // Copies within a file must not overlap.
+        const auto size = s + len - a;
+        if (other == &input && (a < b ? a + size > b : b + size > a)) {
+            return;
+        }
+        end = s + len;
+        found(other, a, b, size);
+    };
+    for (LineNo s = 0; s < wanted.size(); ++s) {
+        if (wanted[s]) {
+            candidates(s, match);
+        }
+    }
+}
+
+// Prints size lines at a in input and at b in other as a pair of duplicates.
+void print_pair(Reporter& reporter, const Input& input, const Input* other,
+                const LineNo a, const LineNo b, const LineNo size) {
+    const std::vector<LineRange> ranges = {LineRange{&input, a, a + size},
+                                           LineRange{other, b, b + size}};
+    std::vector<std::string_view> lines;
+    for (auto j = a; j < a + size; ++j) {
+        lines.push_back(input.get(j));
+    }
+    reporter.print(ranges, lines);
+}
+
+// Like find_matches, but prints each duplicate with the copy in input first.
+template <typename Candidates>
+void report_matches(Reporter& reporter, const Input& input,
+                    const std::vector<bool>& wanted, const std::size_t min,
+                    const unsigned normalize, Candidates candidates) {
+    find_matches(input, wanted, min, normalize, candidates,
+                 [&](const Input* const other, const LineNo a, const LineNo b,
+                     const LineNo size) {
+                     print_pair(reporter, input, other, a, b, size);
+                 });
+}
+
+// =============================================================================
+//       Hash engine
+// =============================================================================
+
+// Where a window starts, packed into 8 bytes.
+struct Occurrence {
+    std::uint32_t input;  // index in the inputs vector
+    std::uint32_t start;
+};
+
+// Open-addressing table from (length, fingerprint) to the occurrences of that
+// window, using linear probing. The first occurrence is stored inline in the
+// slot, so windows that occur once (nearly all of them) need no allocation.
+// Further occurrences are chained through a shared pool.
+class WindowTable {
+   public:
+    void insert(const std::uint32_t len, const Fingerprint& fp,
+                const Occurrence occ) {
+        if ((size_ + 1) * 4 > slots_.size() * 3) {
+            grow();
+        }
+        auto& slot = find(len, fp);
+        if (slot.len == 0) {
+            slot = Slot{fp, len, NIL, occ};
+            ++size_;
+            return;
+        }
+        pool_.push_back(Node{occ, slot.more});
+        slot.more = static_cast<std::uint32_t>(pool_.size() - 1);
+    }
+
+    // Calls f(len, occurrences) for each window that occurs more than once.
+    template <typename F>
+    void for_each_duplicate(F f) const {
+        std::vector<Occurrence> occs;
+        for (const auto& slot : slots_) {
+            if (slot.len == 0 || slot.more == NIL) {
+                continue;
+            }
+            occs.clear();
+            occs.push_back(slot.first);
+            for (auto i = slot.more; i != NIL; i = pool_[i].next) {
+                occs.push_back(pool_[i].occ);
+            }
+            f(slot.len, occs);
+        }
+    }
+
+    void clear() {
+        slots_ = {};
+        pool_ = {};
+        size_ = 0;
+        probes_ = 0;
+    }
+
+    std::size_t size() const { return size_; }
+    std::size_t capacity() const { return slots_.size(); }
+
+    // Number of occupied slots skipped over when looking up windows.
+    std::size_t probes() const { return probes_; }
+
+   private:
+    static constexpr auto NIL = std::numeric_limits<std::uint32_t>::max();
+
+    struct Slot {
+        Fingerprint fp;
+        std::uint32_t len;   // 0 means empty
+        std::uint32_t more;  // head of the chain in pool_
+        Occurrence first;
+    };
+
+    struct Node {
+        Occurrence occ;
+        std::uint32_t next;
+    };
+
+    Slot& find(const std::uint32_t len, const Fingerprint& fp) {
+        const auto mask = slots_.size() - 1;
+        auto i = static_cast<std::size_t>(fp.a ^ len) & mask;
+        while (slots_[i].len != 0 &&
+               !(slots_[i].len == len && slots_[i].fp == fp)) {
+            i = (i + 1) & mask;
+            ++probes_;
+        }
+        return slots_[i];
+    }
+
+    void grow() {
+        auto old = std::move(slots_);
+        slots_.assign(std::max<std::size_t>(1024, old.size() * 2), Slot{});
+        for (const auto& slot : old) {
+            if (slot.len != 0) {
+                find(slot.len, slot.fp) = slot;
+            }
+        }
+    }
+
+    std::vector<Slot> slots_;
+    std::vector<Node> pool_;
+    std::size_t size_ = 0;
+    std::size_t probes_ = 0;
+};
+
+// Orders ranges by input, then by start.
+bool precedes(const LineRange& a, const LineRange& b) {
+    return a.input != b.input ? a.input < b.input : a.start < b.start;
+}
+
+// Orders the largest ranges first, then by position.
+bool larger(const LineRange& a, const LineRange& b) {
+    const auto a_len = a.end - a.start;
+    const auto b_len = b.end - b.start;
+    return a_len != b_len ? a_len > b_len : precedes(a, b);
+}
+
+// Splits sorted ranges into groups with identical lines. Returns the number of
+// times ranges had the same fingerprint but different lines.
+std::size_t verify(std::vector<LineRange> slot,
+                   std::deque<std::vector<LineRange>>& groups) {
+    std::size_t collisions = 0;
+    while (slot.size() >= 2) {
+        const auto first = slot.front();
+        auto it = std::stable_partition(
+            slot.begin(), slot.end(),
+            [&](const LineRange& r) { return same_lines(first, r); });
+        if (it == slot.end()) {
+            groups.push_back(std::move(slot));
+            break;
+        }
+        ++collisions;
+        if (it - slot.begin() >= 2) {
+            groups.emplace_back(slot.begin(), it);
+        }
+        slot.erase(slot.begin(), it);
+    }
+    return collisions;
+}
+
+// Sorts sets of ranges so that the largest come first, then by position.
+void sort_groups(std::vector<const std::vector<LineRange>*>& groups) {
+    std::sort(groups.begin(), groups.end(),
+              [](const std::vector<LineRange>* a,
+                 const std::vector<LineRange>* b) {
+                  return larger(a->front(), b->front());
+              });
+}
+
+// Window index split into shards by fingerprint, so that threads inserting
+// different windows rarely contend.
+class ShardedIndex {
+   public:
+    static constexpr std::size_t NUM_SHARDS = 64;
+
+    struct Entry {
+        std::uint32_t len;
+        Fingerprint fp;
+        Occurrence occ;
+    };
+
+    static std::size_t shard_of(const Fingerprint& fp) {
+        // Use b, since a picks the slot.
+        return fp.b % NUM_SHARDS;
+    }
+
+    // Inserts entries that all belong to the given shard.
+    void insert(const std::size_t shard, const std::vector<Entry>& entries) {
+        auto& s = shards_[shard];
+        std::lock_guard<std::mutex> lock(s.mutex);
+        for (const auto& entry : entries) {
+            s.table.insert(entry.len, entry.fp, entry.occ);
+        }
+    }
+
+    // Returns every set of two or more ranges with identical lines, sorted so
+    // that the largest come first, then by position. Ranges that only share a
+    // fingerprint are split apart by comparing their lines. This empties the
+    // index, and the result is valid until the next call.
+    std::vector<const std::vector<LineRange>*> merge(
+        ThreadPool& pool, const std::vector<Input>& inputs) {
+        for (std::size_t i = 0; i < NUM_SHARDS; ++i) {
+            pool.submit([this, i, &inputs] {
+                auto& shard = shards_[i];
+                shard.groups.clear();
+                std::size_t collisions = 0;
+                shard.table.for_each_duplicate(
+                    [&](const std::uint32_t len,
+                        const std::vector<Occurrence>& occs) {
+                        std::vector<LineRange> slot;
+                        for (const auto occ : occs) {
+                            slot.push_back(LineRange{&inputs[occ.input],
+                                                     occ.start,
+                                                     occ.start + len});
+                        }
+                        std::sort(slot.begin(), slot.end(), precedes);
+                        collisions += verify(std::move(slot), shard.groups);
+                    });
+                STATS.table(shard.table.size(), shard.table.capacity(),
+                            shard.table.probes());
+                STATS.count("collisions", collisions);
+                shard.table.clear();
+            });
+        }
+        pool.wait();
+        std::vector<const std::vector<LineRange>*> groups;
+        for (const auto& shard : shards_) {
+            for (const auto& group : shard.groups) {
+                groups.push_back(&group);
+            }
+        }
+        sort_groups(groups);
+        return groups;
+    }
+
+   private:
+    struct Shard {
+        std::mutex mutex;
+        WindowTable table;
+        std::deque<std::vector<LineRange>> groups;
+    };
+
+    Shard shards_[NUM_SHARDS];
+};
+
+// Buffers entries per shard to take each shard's lock less often.
+class IndexBatches {
+   public:
+    explicit IndexBatches(ShardedIndex& index) : index_(index) {}
+
+    ~IndexBatches() {
+        for (std::size_t shard = 0; shard < ShardedIndex::NUM_SHARDS;
+             ++shard) {
+            index_.insert(shard, batches_[shard]);
+        }
+        STATS.windows(counts_);
+    }
+
+    void add(const std::size_t len, const Fingerprint& fp,
+             const Occurrence occ) {
+        if (counts_.size() <= len) {
+            counts_.resize(len + 1);
+        }
+        ++counts_[len];
+        const auto shard = ShardedIndex::shard_of(fp);
+        auto& batch = batches_[shard];
+        batch.push_back({static_cast<std::uint32_t>(len), fp, occ});
+        if (batch.size() == BATCH) {
+            index_.insert(shard, batch);
+            batch.clear();
+        }
+    }
+
+   private:
+    static constexpr std::size_t BATCH = 256;
+
+    ShardedIndex& index_;
+    std::vector<ShardedIndex::Entry> batches_[ShardedIndex::NUM_SHARDS];
+    // Windows added by length, for --stats.
+    std::vector<std::size_t> counts_;
+};
+
+// Hashes every window of min to max lines that ends in [first, last).
+void hash_windows(const Interner& interner, const Input& input,
+                  const std::uint32_t id, const LineNo first,
+                  const LineNo last, const std::size_t min,
+                  const std::size_t max, ShardedIndex& index) {
+    IndexBatches batches(index);
+    const auto* ids = input.ids();
+    for (auto end = first + 1; end <= last; ++end) {
+        Hasher hasher;
+        LineNo len = 1;
+        for (; len < std::min(min, end); ++len) {
+            const auto start = end - len;
+            hasher.combine(interner.hash(ids[start]));
+        }
+        for (; len >= min && len <= std::min(max, end); ++len) {
+            const auto start = end - len;
+            hasher.combine(interner.hash(ids[start]));
+            batches.add(len, hasher.get(),
+                        Occurrence{id, static_cast<std::uint32_t>(start)});
+        }
+    }
+}
+
+// Hashes every window of exactly len lines that starts in [first, last).
+void hash_windows_of(const Interner& interner, const Input& input,
+                     const std::uint32_t id, const LineNo first,
+                     const LineNo last, const std::size_t len,
+                     ShardedIndex& index) {
+    if (input.end() < len) {
+        return;
+    }
+    const auto stop = std::min(last, input.end() - len + 1);
+    if (stop <= first) {
+        return;
+    }
+    IndexBatches batches(index);
+    const auto* ids = input.ids();
+    RollingHasher hasher(len);
+    auto start = stop - 1;
+    for (auto i = start + len; i > start; --i) {
+        hasher.push(interner.hash(ids[i - 1]));
+    }
+    while (true) {
+        batches.add(len, hasher.get(),
+                    Occurrence{id, static_cast<std::uint32_t>(start)});
+        if (start == first) {
+            break;
+        }
+        --start;
+        hasher.roll(interner.hash(ids[start]), interner.hash(ids[start + len]));
+    }
+}
+
+// Prints pairs of duplicates for --progressive while inputs are still being
+// ingested. Each input is handed over through a bounded queue as soon as its
+// lines are interned, and a dedicated thread pairs its windows of MIN lines
+// with their first copy in the inputs handed over so far, growing each match
+// as far as the lines are equal. Windows are fingerprinted by line ID, since
+// line hashes are not final until ingestion is. Like the full report, each pair
+// puts the copy in the earlier input or line first, and a match longer than
+// MAX lines is split into regions of MAX lines.
+class Progress {
+   public:
+    // Inputs found with -r are handed over too, but are not yet in inputs.
+    Progress(const std::vector<Input>& inputs, const Options& options)
+        : inputs_(inputs),
+          min_(static_cast<std::size_t>(options.min)),
+          max_(static_cast<std::size_t>(options.max)),
+          normalize_(options.normalize),
+          reporter_({}, options),
+          queue_(QUEUE_SIZE),
+          thread_([this] { run(); }) {
+        reporter_.on_print([this](const std::vector<LineRange>& ranges) {
+            const auto pair = normalize(ranges);
+            pairs_[pair.first].push_back(pair.second);
+        });
+    }
+
+    ~Progress() { finish(); }
+
+    // Hands over an input whose lines are all interned. Once called with
+    // nullptr, waits until every input handed over has been matched.
+    void ready(const Input* const input) {
+        if (input != nullptr) {
+            queue_.push(input);
+        } else {
+            finish();
+        }
+    }
+
+    // Returns true if ranges are two copies that lie within a pair already
+    // printed, at the same offsets, so that reporting them adds nothing.
+    bool printed(const std::vector<LineRange>& ranges) const {
+        if (ranges.size() != 2) {
+            return false;
+        }
+        const auto [files, pair] = normalize(ranges);
+        const auto it = pairs_.find(files);
+        if (it == pairs_.end()) {
+            return false;
+        }
+        for (const auto& other : it->second) {
+            if (other.a <= pair.a && pair.a + pair.len <= other.a + other.len &&
+                pair.b - pair.a == other.b - other.a) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+   private:
+    // Inputs waiting to be matched before ingestion blocks.
+    static constexpr std::size_t QUEUE_SIZE = 64;
+
+    struct Window {
+        const Input* input;
+        LineNo start;
+    };
+
+    // Two copies of len lines, at a and b.
+    struct Pair {
+        LineNo a;
+        LineNo b;
+        LineNo len;
+    };
+
+    // Identifies two ranges by file names, since inputs may move once
+    // ingested, ordered so that (file, start) of the first is smaller.
+    using Files = std::pair<std::string, std::string>;
+
+    static std::pair<Files, Pair> normalize(
+        const std::vector<LineRange>& ranges) {
+        auto x = ranges[0];
+        auto y = ranges[1];
+        if (std::make_pair(std::string_view(y.input->name()), y.start) <
+            std::make_pair(std::string_view(x.input->name()), x.start)) {
+            std::swap(x, y);
+        }
+        return {{x.input->name(), y.input->name()},
+                {x.start, y.start, x.end - x.start}};
+    }
+
+    // Orders inputs as the full report does: inputs given on the command line
+    // in order, then files found with -r by path.
+    std::pair<std::size_t, std::string_view> rank(const Input& input) const {
+        const std::less<const Input*> less;
+        if (!less(&input, inputs_.data()) &&
+            less(&input, inputs_.data() + inputs_.size())) {
+            return {static_cast<std::size_t>(&input - inputs_.data()), ""};
+        }
+        return {inputs_.size(), input.name()};
+    }
+
+    void finish() {
+        if (thread_.joinable()) {
+            queue_.close();
+            thread_.join();
+            windows_.clear();
+        }
+    }
+
+    void run() {
+        while (const auto input = queue_.pop()) {
+            match(**input);
+            reporter_.flush();
+        }
+    }
+
+    void match(const Input& input) {
+        const auto* const ids = input.ids();
+        const std::vector<std::uint64_t> hashes(ids, ids + input.end());
+        const auto fps = fingerprint_windows(hashes, min_);
+        const std::vector<bool> wanted(fps.size(), true);
+        find_matches(
+            input, wanted, min_, normalize_,
+            [&](const LineNo s, const auto& match) {
+                const auto [it, first] =
+                    windows_.try_emplace(fps[s], Window{&input, s});
+                if (!first) {
+                    match(it->second.input, s, it->second.start);
+                }
+            },
+            [&](const Input* const other, const LineNo a, const LineNo b,
+                const LineNo size) {
+                const bool swap =
+                    other == &input ? b < a : rank(*other) < rank(input);
+                for (LineNo i = 0; i + min_ <= size; i += max_) {
+                    const auto len = std::min<LineNo>(max_, size - i);
+                    if (swap) {
+                        print_pair(reporter_, *other, &input, b + i, a + i,
+                                   len);
+                    } else {
+                        print_pair(reporter_, input, other, a + i, b + i,
+                                   len);
+                    }
+                }
+            });
+    }
+
+    const std::vector<Input>& inputs_;
+    std::size_t min_;
+    std::size_t max_;
+    unsigned normalize_;
+    Reporter reporter_;
+    std::map<Files, std::vector<Pair>> pairs_;
+    // First copy of each window, which later copies are paired with.
+    std::unordered_map<Fingerprint, Window, FingerprintHash> windows_;
+    BoundedQueue<const Input*> queue_;
+    std::thread thread_;
+};
+
+// Like find_dups_hash, but indexes one length at a time from the largest, and
+// stops once -k sets have been reported, since windows of the remaining
+// lengths could only be reported after them. This bounds memory by the
+// windows of a single length rather than all of them, but not time: when
+// fewer than -k large duplicates exist, it hashes every line once for each
+// length down to MIN, which is slower than one pass over all lengths.
+void find_dups_top(ThreadPool& pool, std::vector<Input>& inputs,
+                   Interner& interner, const Options& options) {
+    const auto min = static_cast<std::size_t>(options.min);
+    const auto max = static_cast<std::size_t>(options.max);
+    ShardedIndex index;
+    Reporter reporter(inputs, options);
+    for (auto len = max; len >= min && !reporter.done(); --len) {
+        for (std::size_t i = 0; i < inputs.size(); ++i) {
+            const auto& input = inputs[i];
+            const auto id = static_cast<std::uint32_t>(i);
+            for_each_chunk(input.end(), [&](LineNo first, LineNo last) {
+                pool.submit([&, id, first, last] {
+                    hash_windows_of(interner, input, id, first, last, len,
+                                    index);
+                });
+            });
+        }
+        pool.wait();
+        for (const auto* group : index.merge(pool, inputs)) {
+            if (reporter.done()) {
+                break;
+            }
+            reporter.report(*group);
+        }
+    }
+}
+
+void find_dups_hash(ThreadPool& pool, std::vector<Input>& inputs,
+                    const Options& options) {
+    const auto min = static_cast<std::size_t>(options.min);
+    const auto max = static_cast<std::size_t>(options.max);
+    Interner interner(options.normalize);
+    std::optional<Progress> progress;
+    std::function<void(const Input*)> ready;
+    if (options.progressive) {
+        progress.emplace(inputs, options);
+        ready = [&progress](const Input* const input) {
+            progress->ready(input);
+        };
+    }
+    ingest(pool, inputs, interner, options, ready);
+    STATS.phase("ingest");
+    if (options.top != 0) {
+        find_dups_top(pool, inputs, interner, options);
+        return;
+    }
+    ShardedIndex index;
+    for (std::size_t i = 0; i < inputs.size(); ++i) {
+        const auto& input = inputs[i];
+        const auto id = static_cast<std::uint32_t>(i);
+        for_each_chunk(input.end(), [&](LineNo first, LineNo last) {
+            pool.submit([&, id, first, last] {
+                hash_windows(interner, input, id, first, last, min, max,
+                             index);
+            });
+        });
+    }
+    pool.wait();
+    // Report the largest duplicates first, and skip over any smaller
+    // duplicates contained within them.
+    const auto groups = index.merge(pool, inputs);
+    STATS.phase("index");
+    Reporter reporter(inputs, options);
+    if (progress) {
+        reporter.skip_if([&progress](const std::vector<LineRange>& ranges) {
+            return progress->printed(ranges);
+        });
+    }
+    for (const auto* group : groups) {
+        if (reporter.done()) {
+            break;
+        }
+        reporter.report(*group);
+    }
+}
+
+// =============================================================================
+//       Sort engine
+// =============================================================================
+
+// Window of min to max lines, as one element of the sort engine's flat array.
+struct SortWindow {
+    Fingerprint fp;
+    std::uint32_t len;
+    Occurrence occ;
+};
+
+// Number of windows of min to max lines that end in (first, last].
+std::size_t count_windows(const LineNo first, const LineNo last,
+                          const std::size_t min, const std::size_t max) {
+    std::size_t count = 0;
+    for (auto end = first + 1; end <= last; ++end) {
+        if (end >= min) {
+            count += std::min(max, end) - min + 1;
+        }
+    }
+    return count;
+}
+
+// Like hash_windows, but writes the windows to out instead of a table.
+void emit_windows(const Interner& interner, const Input& input,
+                  const std::uint32_t id, const LineNo first,
+                  const LineNo last, const std::size_t min,
+                  const std::size_t max, SortWindow* out) {
+    std::vector<std::size_t> counts(max + 1);
+    const auto* ids = input.ids();
+    for (auto end = first + 1; end <= last; ++end) {
+        Hasher hasher;
+        LineNo len = 1;
+        for (; len < std::min(min, end); ++len) {
+            hasher.combine(interner.hash(ids[end - len]));
+        }
+        for (; len >= min && len <= std::min(max, end); ++len) {
+            const auto start = end - len;
+            hasher.combine(interner.hash(ids[start]));
+            *out++ = SortWindow{
+                hasher.get(), static_cast<std::uint32_t>(len),
+                Occurrence{id, static_cast<std::uint32_t>(start)}};
+            ++counts[len];
+        }
+    }
+    STATS.windows(counts);
+}
+
+// Bits of fp.a, which is below 2^61, used to split windows into buckets.
+constexpr int BUCKET_BITS = 8;
+constexpr int BUCKET_SHIFT = 61 - BUCKET_BITS;
+
+// Sorts windows by fp.a with one counting pass per byte below the bucket
+// bits, from the least significant, moving them back and forth between data
+// and scratch. Bytes that are the same in every window are skipped. Returns
+// whichever of the two holds the result.
+SortWindow* radix_sort(SortWindow* data, SortWindow* scratch,
+                       const std::size_t n) {
+    for (int shift = 0; shift < BUCKET_SHIFT; shift += 8) {
+        std::size_t offsets[256] = {};
+        for (std::size_t i = 0; i < n; ++i) {
+            ++offsets[data[i].fp.a >> shift & 0xff];
+        }
+        if (offsets[data[0].fp.a >> shift & 0xff] == n) {
+            continue;
+        }
+        std::size_t sum = 0;
+        for (auto& offset : offsets) {
+            sum += std::exchange(offset, sum);
+        }
+        for (std::size_t i = 0; i < n; ++i) {
+            scratch[offsets[data[i].fp.a >> shift & 0xff]++] = data[i];
+        }
+        std::swap(data, scratch);
+    }
+    return data;
+}
+
+// Finds windows with the same length and fingerprint in a sorted bucket, and
+// adds them to groups after comparing their lines. Returns the number of
+// fingerprint collisions.
+std::size_t group_windows(const SortWindow* const windows, const std::size_t n,
+                          const std::vector<Input>& inputs,
+                          std::deque<std::vector<LineRange>>& groups) {
+    std::size_t collisions = 0;
+    std::vector<SortWindow> run;
+    for (std::size_t i = 0; i < n;) {
+        auto j = i + 1;
+        while (j < n && windows[j].fp.a == windows[i].fp.a) {
+            ++j;
+        }
+        if (j - i < 2) {
+            i = j;
+            continue;
+        }
+        // Runs are nearly always copies of one window, so this is cheap.
+        run.assign(windows + i, windows + j);
+        std::sort(run.begin(), run.end(),
+                  [](const SortWindow& x, const SortWindow& y) {
+                      return std::tie(x.len, x.fp.b, x.occ.input,
+                                      x.occ.start) <
+                             std::tie(y.len, y.fp.b, y.occ.input, y.occ.start);
+                  });
+        for (std::size_t k = 0; k < run.size();) {
+            std::vector<LineRange> slot;
+            auto l = k;
+            for (; l < run.size() && run[l].len == run[k].len &&
+                   run[l].fp.b == run[k].fp.b;
+                 ++l) {
+                const auto occ = run[l].occ;
+                slot.push_back(LineRange{&inputs[occ.input], occ.start,
+                                         occ.start + run[l].len});
+            }
+            collisions += verify(std::move(slot), groups);
+            k = l;
+        }
+        i = j;
+    }
+    return collisions;
+}
+
+// Like find_dups_hash, but writes every window into one flat array, sorts it
+// by fingerprint with a parallel radix sort, and finds duplicates in a linear
+// scan. Memory use depends only on the number of windows.
+void find_dups_sort(ThreadPool& pool, std::vector<Input>& inputs,
+                    const Options& options) {
+    const auto min = static_cast<std::size_t>(options.min);
+    const auto max = static_cast<std::size_t>(options.max);
+    Interner interner(options.normalize);
+    ingest(pool, inputs, interner, options);
+    STATS.phase("ingest");
+
+    // Give each chunk of lines its own part of the array.
+    struct Chunk {
+        std::uint32_t input;
+        LineNo first;
+        LineNo last;
+        std::size_t offset;
+    };
+    std::vector<Chunk> chunks;
+    std::size_t num_windows = 0;
+    for (std::size_t i = 0; i < inputs.size(); ++i) {
+        for_each_chunk(inputs[i].end(), [&](LineNo first, LineNo last) {
+            chunks.push_back(
+                Chunk{static_cast<std::uint32_t>(i), first, last, num_windows});
+            num_windows += count_windows(first, last, min, max);
+        });
+    }
+    std::vector<SortWindow> windows(num_windows);
+    std::vector<SortWindow> sorted(num_windows);
+    for (const auto chunk : chunks) {
+        pool.submit([&, chunk] {
+            emit_windows(interner, inputs[chunk.input], chunk.input,
+                         chunk.first, chunk.last, min, max,
+                         windows.data() + chunk.offset);
+        });
+    }
+    pool.wait();
+    STATS.phase("index");
+
+    // Scatter windows into buckets by their top bits, with each task
+    // counting and then moving its own slice so that no locks are needed.
+    constexpr std::size_t NUM_BUCKETS = std::size_t{1} << BUCKET_BITS;
+    const auto bucket_of = [](const SortWindow& w) {
+        return static_cast<std::size_t>(w.fp.a >> BUCKET_SHIFT);
+    };
+    const std::size_t num_tasks = pool.size();
+    const auto slice = (num_windows + num_tasks - 1) / num_tasks;
+    std::vector<std::array<std::size_t, NUM_BUCKETS>> counts(num_tasks);
+    for (std::size_t t = 0; t < num_tasks; ++t) {
+        pool.submit([&, t] {
+            auto& count = counts[t];
+            count.fill(0);
+            const auto end = std::min(num_windows, (t + 1) * slice);
+            for (auto i = t * slice; i < end; ++i) {
+                ++count[bucket_of(windows[i])];
+            }
+        });
+    }
+    pool.wait();
+    std::vector<std::size_t> bucket_starts(NUM_BUCKETS + 1);
+    std::size_t sum = 0;
+    for (std::size_t b = 0; b < NUM_BUCKETS; ++b) {
+        bucket_starts[b] = sum;
+        for (auto& count : counts) {
+            sum += std::exchange(count[b], sum);
+        }
+    }
+    bucket_starts[NUM_BUCKETS] = sum;
+    for (std::size_t t = 0; t < num_tasks; ++t) {
+        pool.submit([&, t] {
+            auto& offsets = counts[t];
+            const auto end = std::min(num_windows, (t + 1) * slice);
+            for (auto i = t * slice; i < end; ++i) {
+                sorted[offsets[bucket_of(windows[i])]++] = windows[i];
+            }
+        });
+    }
+    pool.wait();
+
+    // Sort and scan each bucket separately, using the original array as
+    // scratch space.
+    std::deque<std::vector<LineRange>> bucket_groups[NUM_BUCKETS];
+    for (std::size_t b = 0; b < NUM_BUCKETS; ++b) {
+        pool.submit([&, b] {
+            const auto start = bucket_starts[b];
+            const auto n = bucket_starts[b + 1] - start;
+            if (n < 2) {
+                return;
+            }
+            const auto* const result =
+                radix_sort(sorted.data() + start, windows.data() + start, n);
+            STATS.count("collisions",
+                        group_windows(result, n, inputs, bucket_groups[b]));
+        });
+    }
+    pool.wait();
+    windows = {};
+    sorted = {};
+    std::vector<const std::vector<LineRange>*> groups;
+    for (const auto& bucket : bucket_groups) {
+        for (const auto& group : bucket) {
+            groups.push_back(&group);
+        }
+    }
+    sort_groups(groups);
+    STATS.phase("sort");
+    Reporter reporter(inputs, options);
+    for (const auto* group : groups) {
+        if (reporter.done()) {
+            break;
+        }
+        reporter.report(*group);
+    }
+}
+
+// =============================================================================
+//       Out-of-core mode
+// =============================================================================
+
+// Unnamed temporary file in $TMPDIR. It is unlinked as soon as it is created,
+// so it disappears when closed.
+class TempFile {
+   public:
+    TempFile() {
+        const char* dir = std::getenv("TMPDIR");
+        if (dir == nullptr || *dir == '\0') {
+            dir = "/tmp";
+        }
+        std::string path = std::string(dir) + "/duplines.XXXXXX";
+        fd_ = mkstemp(path.data());
+        if (fd_ == -1) {
+            fail("%s: %s", path.c_str(), std::strerror(errno));
+        }
+        unlink(path.c_str());
+    }
+
+    TempFile(const TempFile&) = delete;
+    TempFile& operator=(const TempFile&) = delete;
+
+    ~TempFile() { close(fd_); }
+
+    // Appends data and returns the offset it was written at. Thread-safe.
+    std::uint64_t append(const void* const data, const std::size_t size) {
+        const auto offset = size_.fetch_add(size);
+        auto p = static_cast<const char*>(data);
+        for (std::size_t done = 0; done < size;) {
+            const auto n = pwrite(fd_, p + done, size - done,
+                                  static_cast<off_t>(offset + done));
+            if (n < 0) {
+                fail("writing temporary file: %s", std::strerror(errno));
+            }
+            done += static_cast<std::size_t>(n);
+        }
+        return offset;
+    }
+
+    void read(const std::uint64_t offset, void* const data,
+              const std::size_t size) const {
+        auto p = static_cast<char*>(data);
+        for (std::size_t done = 0; done < size;) {
+            const auto n = pread(fd_, p + done, size - done,
+                                 static_cast<off_t>(offset + done));
+            if (n <= 0) {
+                fail("reading temporary file: %s",
+                     n == 0 ? "unexpected end" : std::strerror(errno));
+            }
+            done += static_cast<std::size_t>(n);
+        }
+    }
+
+   private:
+    int fd_;
+    std::atomic<std::uint64_t> size_{0};
+};
+
+// Sorts more records than fit in memory. Each pool worker fills its own
+// buffer, and sorts and spills it to a temporary file as a run when full.
+// Runs are then combined with k-way merges.
+template <typename T, typename Less>
+class ExternalSorter {
+   public:
+    ExternalSorter(const std::size_t memory, const unsigned num_workers)
+        : buffer_records_(std::max<std::size_t>(
+              1024, memory / sizeof(T) / num_workers)),
+          max_fan_in_(std::max<std::size_t>(
+              2, memory / (READ_RECORDS * sizeof(T)))),
+          buffers_(num_workers) {}
+
+    // Adds a record. Call from pool workers only, or from one other thread.
+    void add(const T& record) {
+        auto& buffer = buffers_[WORKER == -1 ? 0 : WORKER];
+        if (buffer.capacity() == 0) {
+            buffer.reserve(buffer_records_);
+        }
+        buffer.push_back(record);
+        if (buffer.size() == buffer_records_) {
+            spill(buffer);
+        }
+    }
+
+    // Calls f(record) for every record in sorted order.
+    template <typename F>
+    void merge(F f) {
+        for (auto& buffer : buffers_) {
+            spill(buffer);
+            buffer = {};
+        }
+        // Merge runs until a single pass can combine the rest.
+        while (runs_.size() > max_fan_in_) {
+            std::vector<Run> merged;
+            for (std::size_t i = 0; i < runs_.size(); i += max_fan_in_) {
+                const auto end = std::min(runs_.size(), i + max_fan_in_);
+                std::vector<Run> group(runs_.begin() + i, runs_.begin() + end);
+                std::vector<T> out;
+                out.reserve(READ_RECORDS);
+                const auto offset = file_.append(nullptr, 0);
+                std::size_t count = 0;
+                merge_runs(group, [&](const T& record) {
+                    out.push_back(record);
+                    if (out.size() == READ_RECORDS) {
+                        file_.append(out.data(), out.size() * sizeof(T));
+                        count += out.size();
+                        out.clear();
+                    }
+                });
+                file_.append(out.data(), out.size() * sizeof(T));
+                count += out.size();
+                merged.push_back(Run{offset, count});
+            }
+            runs_ = std::move(merged);
+        }
+        merge_runs(runs_, f);
+    }
+
+   private:
+    static constexpr std::size_t READ_RECORDS = 1 << 14;
+
+    struct Run {
+        std::uint64_t offset;
+        std::size_t count;
+    };
+
+    struct Cursor {
+        Run run;
+        std::vector<T> buffer;
+        std::size_t index = 0;
+    };
+
+    void spill(std::vector<T>& buffer) {
+        if (buffer.empty()) {
+            return;
+        }
+        std::sort(buffer.begin(), buffer.end(), Less());
+        const auto offset =
+            file_.append(buffer.data(), buffer.size() * sizeof(T));
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            runs_.push_back(Run{offset, buffer.size()});
+        }
+        buffer.clear();
+    }
+
+    bool refill(Cursor& cursor) const {
+        const auto n = std::min(cursor.run.count, READ_RECORDS);
+        if (n == 0) {
+            return false;
+        }
+        cursor.buffer.resize(n);
+        file_.read(cursor.run.offset, cursor.buffer.data(), n * sizeof(T));
+        cursor.run.offset += n * sizeof(T);
+        cursor.run.count -= n;
+        cursor.index = 0;
+        return true;
+    }
+
+    template <typename F>
+    void merge_runs(const std::vector<Run>& runs, F f) const {
+        std::vector<Cursor> cursors(runs.size());
+        auto greater = [&](std::size_t a, std::size_t b) {
+            const auto& x = cursors[a];
+            const auto& y = cursors[b];
+            return Less()(y.buffer[y.index], x.buffer[x.index]);
+        };
+        std::priority_queue<std::size_t, std::vector<std::size_t>,
+                            decltype(greater)>
+            heap(greater);
+        for (std::size_t i = 0; i < runs.size(); ++i) {
+            cursors[i].run = runs[i];
+            if (refill(cursors[i])) {
+                heap.push(i);
+            }
+        }
+        while (!heap.empty()) {
+            const auto i = heap.top();
+            heap.pop();
+            auto& cursor = cursors[i];
+            f(cursor.buffer[cursor.index]);
+            if (++cursor.index < cursor.buffer.size() || refill(cursor)) {
+                heap.push(i);
+            }
+        }
+    }
+
+    const std::size_t buffer_records_;
+    const std::size_t max_fan_in_;
+    std::vector<std::vector<T>> buffers_;
+    std::mutex mutex_;
+    std::vector<Run> runs_;
+    TempFile file_;
+};
+
+// A window, sorted so that the largest come first and identical windows are
+// adjacent.
+struct WindowRecord {
+    Fingerprint fp;
+    std::uint32_t len;
+    Occurrence occ;
+
+    struct Less {
+        bool operator()(const WindowRecord& x, const WindowRecord& y) const {
+            if (x.len != y.len) {
+                return x.len > y.len;
+            }
+            if (x.fp.a != y.fp.a) {
+                return x.fp.a < y.fp.a;
+            }
+            if (x.fp.b != y.fp.b) {
+                return x.fp.b < y.fp.b;
+            }
+            return x.occ.input != y.occ.input ? x.occ.input < y.occ.input
+                                              : x.occ.start < y.occ.start;
+        }
+    };
+};
+
+// A set of windows with the same fingerprint, sorted in reporting order. Its
+// occurrences are stored at the given offset in a temporary file.
+struct HitRecord {
+    std::uint32_t len;
+    Occurrence first;
+    std::uint64_t offset;
+
+    struct Less {
+        bool operator()(const HitRecord& x, const HitRecord& y) const {
+            if (x.len != y.len) {
+                return x.len > y.len;
+            }
+            return x.first.input != y.first.input
+                       ? x.first.input < y.first.input
+                       : x.first.start < y.first.start;
+        }
+    };
+};
+
+// Returns true if the regions have the same lines after normalization.
+bool same_texts(const std::vector<std::string>& a,
+                const std::vector<std::string>& b, const unsigned mode) {
+    return std::equal(a.begin(), a.end(), b.begin(), b.end(),
+                      [mode](const std::string& x, const std::string& y) {
+                          return same_text(x, y, mode);
+                      });
+}
+
+// Like find_dups_hash, but keeps only a ring of recent line hashes per input
+// in memory. Windows are sorted on disk to find duplicates, and the lines of
+// each duplicate are read from disk again to verify and print them.
+void find_dups_external(ThreadPool& pool, std::vector<Input>& inputs,
+                        const Options& options) {
+    const auto min = static_cast<std::size_t>(options.min);
+    const auto max = static_cast<std::size_t>(options.max);
+    // Windows are merged while hits are buffered, so split memory between
+    // the two sorters.
+    const auto memory = options.memory_limit / 2;
+    Walker walker(pool, [](Input&) {});
+    walker.start(options);
+    pool.wait();
+    walker.finish(inputs);
+    ExternalSorter<WindowRecord, WindowRecord::Less> windows(memory,
+                                                             pool.size());
+    for (std::size_t i = 0; i < inputs.size(); ++i) {
+        pool.submit([&input = inputs[i], &windows, &options, i, min, max] {
+            std::vector<std::uint64_t> ring(max);
+            std::vector<std::size_t> counts(max + 1);
+            std::string_view line;
+            for (LineNo end = 1; input.scan(line); ++end) {
+                ring[end % max] = hash_line(line, options.normalize);
+                Hasher hasher;
+                for (LineNo len = 1; len <= std::min(max, end); ++len) {
+                    const auto start = end - len;
+                    hasher.combine(ring[(start + 1) % max]);
+                    if (len >= min) {
+                        ++counts[len];
+                        windows.add(WindowRecord{
+                            hasher.get(), static_cast<std::uint32_t>(len),
+                            Occurrence{static_cast<std::uint32_t>(i),
+                                       static_cast<std::uint32_t>(start)}});
+                    }
+                }
+            }
+            input.unmap();
+            STATS.windows(counts);
+        });
+    }
+    pool.wait();
+    STATS.phase("ingest");
+
+    // Collect sets of two or more windows, storing their occurrences in a
+    // temporary file as a count followed by the occurrences.
+    TempFile groups;
+    ExternalSorter<HitRecord, HitRecord::Less> hits(memory, 1);
+    std::vector<Occurrence> pending;
+    std::uint64_t written = 0;
+    std::vector<Occurrence> group;
+    std::optional<WindowRecord> last;
+    auto flush_group = [&] {
+        if (group.size() >= 2) {
+            hits.add(HitRecord{last->len, group.front(),
+                               written + pending.size() * sizeof(Occurrence)});
+            pending.push_back(
+                Occurrence{static_cast<std::uint32_t>(group.size()), 0});
+            pending.insert(pending.end(), group.begin(), group.end());
+            if (pending.size() >= (1 << 16)) {
+                groups.append(pending.data(),
+                              pending.size() * sizeof(Occurrence));
+                written += pending.size() * sizeof(Occurrence);
+                pending.clear();
+            }
+        }
+        group.clear();
+    };
+    windows.merge([&](const WindowRecord& record) {
+        if (last && !(record.len == last->len && record.fp == last->fp)) {
+            flush_group();
+        }
+        group.push_back(record.occ);
+        last = record;
+    });
+    if (last) {
+        flush_group();
+    }
+    groups.append(pending.data(), pending.size() * sizeof(Occurrence));
+    pending = {};
+
+    // Report the largest duplicates first. Ranges that only share a
+    // fingerprint are split apart by comparing their lines.
+    STATS.phase("index");
+    Reporter reporter(inputs, options);
+    std::vector<LineRange> ranges;
+    std::vector<std::vector<std::string>> texts;
+    hits.merge([&](const HitRecord& hit) {
+        Occurrence header;
+        groups.read(hit.offset, &header, sizeof header);
+        group.resize(header.input);
+        groups.read(hit.offset + sizeof header, group.data(),
+                    group.size() * sizeof(Occurrence));
+        ranges.clear();
+        texts.clear();
+        for (const auto occ : group) {
+            ranges.push_back(
+                LineRange{&inputs[occ.input], occ.start, occ.start + hit.len});
+        }
+        // Avoid reading lines from disk if nothing can be reported.
+        if (reporter.done() || reporter.covered(ranges)) {
+            return;
+        }
+        for (const auto range : ranges) {
+            texts.push_back(range.input->reread(range.start, range.end));
+        }
+        while (ranges.size() >= 2) {
+            const auto first = std::move(texts[0]);
+            std::vector<LineRange> same{ranges[0]};
+            std::size_t kept = 0;
+            for (std::size_t j = 1; j < ranges.size(); ++j) {
+                if (same_texts(texts[j], first, options.normalize)) {
+                    same.push_back(ranges[j]);
+                } else {
+                    ranges[kept] = ranges[j];
+                    texts[kept] = std::move(texts[j]);
+                    ++kept;
+                }
+            }
+            if (same.size() >= 2 && !reporter.done() && reporter.claim(same)) {
+                reporter.print(same, first);
+            }
+            ranges.resize(kept);
+            texts.resize(kept);
+        }
+    });
+}
+
+// =============================================================================
+//       Streaming mode
+// =============================================================================
+
+// Memory for the fingerprints of recent windows, without --memory-limit.
+constexpr std::size_t STREAM_MEMORY = 64 << 20;
+
+// Bounded table from the fingerprints of windows to where they first occurred,
+// as positions in the concatenation of all inputs. A fingerprint can only go
+// in one bucket of a few slots, and when that is full, the window that
+// occurred earliest in it is forgotten.
+class RecentWindows {
+   public:
+    explicit RecentWindows(const std::size_t memory) {
+        std::size_t num_buckets = 1;
+        while (num_buckets * 2 * sizeof(Bucket) <= memory) {
+            num_buckets *= 2;
+        }
+        buckets_.resize(num_buckets);
+    }
+
+    // Returns where an equal window first occurred, or else records this one
+    // as occurring at pos and returns nullopt.
+    std::optional<std::uint64_t> find_or_add(const Fingerprint& fp,
+                                             const std::uint64_t pos) {
+        auto& bucket = buckets_[fp.a & (buckets_.size() - 1)];
+        Slot* oldest = &bucket.slots[0];
+        for (auto& slot : bucket.slots) {
+            if (slot.pos != 0 && slot.fp == fp) {
+                return slot.pos - 1;
+            }
+            if (slot.pos < oldest->pos) {
+                oldest = &slot;
+            }
+        }
+        *oldest = Slot{fp, pos + 1};
+        return std::nullopt;
+    }
+
+   private:
+    static constexpr std::size_t WAYS = 4;
+
+    struct Slot {
+        Fingerprint fp;
+        std::uint64_t pos;  // position plus 1, or 0 if empty
+    };
+
+    struct Bucket {
+        Slot slots[WAYS];
+    };
+
+    std::vector<Bucket> buckets_;
+};
+
+// Finds duplicates in inputs that can only be read once, such as pipes, using
+// bounded memory. Only the last MAX lines are kept, along with fingerprints of
+// recent windows of MIN lines. A window equal to an earlier one starts a
+// duplicate, which grows while the following windows match the ones following
+// the earlier copy, up to MAX lines, and is printed as soon as it ends. Each
+// copy is paired with the first, and older copies are compared by fingerprint
+// alone since their lines are gone.
+void find_dups_stream(std::vector<Input>& inputs, const Options& options) {
+    const auto min = static_cast<std::size_t>(options.min);
+    const auto max = static_cast<std::size_t>(options.max);
+    RecentWindows windows(options.memory_limit != 0 ? options.memory_limit
+                                                    : STREAM_MEMORY);
+    // The last lines and their hashes, indexed by position. There must be
+    // room for a duplicate of max lines after the line just read.
+    std::size_t ring_size = 1;
+    while (ring_size <= max) {
+        ring_size *= 2;
+    }
+    const auto mask = ring_size - 1;
+    std::vector<std::string> ring(ring_size);
+    std::vector<std::uint64_t> hashes(ring_size);
+    // Position of the first line of each input.
+    std::vector<std::uint64_t> starts;
+    const auto range_at = [&](const std::uint64_t pos, const std::size_t len) {
+        const auto i = static_cast<std::size_t>(
+            std::upper_bound(starts.begin(), starts.end(), pos) -
+            starts.begin() - 1);
+        const auto start = static_cast<LineNo>(pos - starts[i]);
+        return LineRange{&inputs[i], start, start + len};
+    };
+
+    // The duplicate being grown, with the earlier copy at older.
+    struct Run {
+        std::uint64_t older;
+        std::uint64_t start;
+        std::size_t len;
+    };
+    std::optional<Run> run;
+    // Windows starting before this overlap a printed duplicate.
+    std::uint64_t barrier = 0;
+    Reporter reporter(inputs, options);
+    std::vector<LineRange> ranges(2);
+    std::vector<std::string_view> lines;
+    const auto finish = [&] {
+        if (!run) {
+            return;
+        }
+        ranges[0] = range_at(run->older, run->len);
+        ranges[1] = range_at(run->start, run->len);
+        lines.clear();
+        for (auto pos = run->start; pos < run->start + run->len; ++pos) {
+            lines.push_back(ring[pos & mask]);
+        }
+        reporter.print(ranges, lines);
+        reporter.flush();
+        barrier = run->start + run->len;
+        run.reset();
+    };
+
+    std::uint64_t pos = 0;
+    for (auto& input : inputs) {
+        finish();
+        starts.push_back(pos);
+        RollingHasher hasher(min);
+        std::string_view text;
+        for (LineNo n = 1; input.stream(text); ++n, ++pos) {
+            ring[pos & mask].assign(text);
+            const auto hash = hash_line(text, options.normalize);
+            hashes[pos & mask] = hash;
+            if (n <= min) {
+                hasher.push(hash);
+                if (n < min) {
+                    continue;
+                }
+            } else {
+                hasher.roll(hash, hashes[(pos - min) & mask]);
+            }
+            const auto start = pos + 1 - min;
+            const auto older = windows.find_or_add(hasher.get(), start);
+            if (run) {
+                // Grow unless the copies would overlap.
+                const auto next = run->older + run->len - min + 1;
+                if (older == next && run->len < max &&
+                    run->older + run->len < run->start) {
+                    ++run->len;
+                    continue;
+                }
+                finish();
+            }
+            if (older && start >= barrier && *older + min <= start) {
+                run = Run{*older, start, min};
+            }
+        }
+    }
+    finish();
+    STATS.phase("stream");
+}
+
+// =============================================================================
+//       Index and query
+// =============================================================================
+
+// Fingerprints every window of len lines of an input that has been read.
+std::vector<Fingerprint> fingerprint_input(const Input& input,
+                                           const std::size_t len,
+                                           const unsigned normalize) {
+    std::vector<std::uint64_t> hashes(input.end());
+    for (LineNo i = 0; i < input.end(); ++i) {
+        hashes[i] = hash_line(input.get(i), normalize);
+    }
+    return fingerprint_windows(hashes, len);
+}
+
+// Path used to match files in an index with files in a diff.
+std::string index_path(const std::string_view path) {
+    return std::filesystem::path(path).lexically_normal().string();
+}
+
+// Persistent index of every window of MIN lines in a tree, written by
+// --build-index and read by --query. The layout is:
+//
+//     Header
+//     Window windows[num_windows], sorted by fingerprint
+//     char paths[num_files][], each terminated by NUL
+class WindowIndex {
+   public:
+    struct Window {
+        Fingerprint fp;
+        std::uint32_t file;
+        std::uint32_t start;
+    };
+
+    // Maps an index, failing if it is missing or corrupt.
+    explicit WindowIndex(const char* const path) {
+        const int fd = ::open(path, O_RDONLY);
+        if (fd == -1) {
+            fail("%s: %s", path, std::strerror(errno));
+        }
+        struct stat st;
+        if (fstat(fd, &st) == -1) {
+            fail("%s: %s", path, std::strerror(errno));
+        }
+        size_ = static_cast<std::size_t>(st.st_size);
+        if (size_ < sizeof(Header)) {
+            fail("%s: not a duplines index", path);
+        }
+        void* const addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            fail("%s: %s", path, std::strerror(errno));
+        }
+        ::close(fd);
+        data_ = static_cast<const char*>(addr);
+        const auto* header = reinterpret_cast<const Header*>(data_);
+        if (std::memcmp(header->magic, MAGIC, sizeof header->magic) != 0 ||
+            header->version != VERSION ||
+            header->num_windows > (size_ - sizeof(Header)) / sizeof(Window)) {
+            fail("%s: not a duplines index", path);
+        }
+        normalize_ = header->normalize;
+        min_ = header->min;
+        windows_ = reinterpret_cast<const Window*>(data_ + sizeof(Header));
+        num_windows_ = header->num_windows;
+        const char* p = reinterpret_cast<const char*>(windows_ + num_windows_);
+        const char* const end = data_ + size_;
+        for (std::uint32_t i = 0; i < header->num_files; ++i) {
+            const auto* nul =
+                static_cast<const char*>(std::memchr(p, '\0', end - p));
+            if (nul == nullptr) {
+                fail("%s: not a duplines index", path);
+            }
+            paths_.emplace_back(p, nul);
+            p = nul + 1;
+        }
+    }
+
+    WindowIndex(const WindowIndex&) = delete;
+    WindowIndex& operator=(const WindowIndex&) = delete;
+
+    ~WindowIndex() { munmap(const_cast<char*>(data_), size_); }
+
+    // Writes an index of the inputs, which must have been ingested.
+    static void write(const char* const path, ThreadPool& pool,
+                      const std::vector<Input>& inputs,
+                      const Interner& interner, const Options& options) {
+        const auto min = static_cast<std::size_t>(options.min);
+        std::vector<std::vector<Window>> found(inputs.size());
+        for (std::size_t i = 0; i < inputs.size(); ++i) {
+            pool.submit([&, i] {
+                const auto& input = inputs[i];
+                std::vector<std::uint64_t> hashes(input.end());
+                for (LineNo j = 0; j < input.end(); ++j) {
+                    hashes[j] = interner.hash(input.ids()[j]);
+                }
+                const auto fps = fingerprint_windows(hashes, min);
+                for (std::size_t start = 0; start < fps.size(); ++start) {
+                    found[i].push_back(
+                        Window{fps[start], static_cast<std::uint32_t>(i),
+                               static_cast<std::uint32_t>(start)});
+                }
+            });
+        }
+        pool.wait();
+        std::vector<Window> windows;
+        for (auto& w : found) {
+            windows.insert(windows.end(), w.begin(), w.end());
+            w = {};
+        }
+        std::sort(windows.begin(), windows.end(), less);
+        STATS.phase("index");
+
+        std::string tmp = std::string(path) + ".XXXXXX";
+        const int fd = mkstemp(tmp.data());
+        if (fd == -1) {
+            fail("%s: %s", tmp.c_str(), std::strerror(errno));
+        }
+        FILE* const file = fdopen(fd, "wb");
+        // Leave the old index in place if anything fails.
+        const auto check = [&](const bool ok, const char* const name) {
+            if (!ok) {
+                const int err = errno;
+                unlink(tmp.c_str());
+                fail("%s: %s", name, std::strerror(err));
+            }
+        };
+        check(file != nullptr, tmp.c_str());
+        const auto write = [&](const void* const data, const std::size_t size,
+                               const std::size_t count) {
+            check(std::fwrite(data, size, count, file) == count, tmp.c_str());
+        };
+        Header header{};
+        std::memcpy(header.magic, MAGIC, sizeof header.magic);
+        header.version = VERSION;
+        header.normalize = options.normalize;
+        header.min = static_cast<std::uint32_t>(min);
+        header.num_files = static_cast<std::uint32_t>(inputs.size());
+        header.num_windows = windows.size();
+        write(&header, sizeof header, 1);
+        write(windows.data(), sizeof(Window), windows.size());
+        for (const auto& input : inputs) {
+            const auto name = index_path(input.name());
+            write(name.c_str(), 1, name.size() + 1);
+        }
+        check(std::fflush(file) == 0 && fsync(fd) == 0, tmp.c_str());
+        check(std::fclose(file) == 0, tmp.c_str());
+        check(rename(tmp.c_str(), path) == 0, path);
+    }
+
+    unsigned normalize() const { return normalize_; }
+    std::size_t min() const { return min_; }
+    const std::string& path(const std::uint32_t file) const {
+        return paths_[file];
+    }
+
+    // Returns the windows with the given fingerprint, in order of file and
+    // start.
+    std::pair<const Window*, const Window*> find(const Fingerprint& fp) const {
+        return std::equal_range(windows_, windows_ + num_windows_,
+                                Window{fp, 0, 0},
+                                [](const Window& x, const Window& y) {
+                                    return x.fp.a != y.fp.a ? x.fp.a < y.fp.a
+                                                            : x.fp.b < y.fp.b;
+                                });
+    }
+
+   private:
+    static constexpr char MAGIC[8] = {'D', 'U', 'P', 'I', 'N', 'D', 'E', 'X'};
+    static constexpr std::uint32_t VERSION = 1;
+
+    struct Header {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t normalize;
+        std::uint32_t min;
+        std::uint32_t num_files;
+        std::uint64_t num_windows;
+    };
+
+    static bool less(const Window& x, const Window& y) {
+        if (x.fp.a != y.fp.a) {
+            return x.fp.a < y.fp.a;
+        }
+        if (x.fp.b != y.fp.b) {
+            return x.fp.b < y.fp.b;
+        }
+        return x.file != y.file ? x.file < y.file : x.start < y.start;
+    }
+
+    const char* data_ = nullptr;
+    std::size_t size_ = 0;
+    unsigned normalize_ = 0;
+    std::size_t min_ = 0;
+    const Window* windows_ = nullptr;
+    std::size_t num_windows_ = 0;
+    std::vector<std::string> paths_;
+};
+
+void build_index(std::vector<Input>& inputs, const Options& options) {
+    if (options.stats) {
+        STATS.start();
+    }
+    ThreadPool pool(static_cast<unsigned>(options.jobs));
+    Interner interner(options.normalize);
+    ingest(pool, inputs, interner, options);
+    STATS.phase("ingest");
+    WindowIndex::write(options.build_index, pool, inputs, interner, options);
+    STATS.phase("write");
+    std::size_t num_lines = 0;
+    for (const auto& input : inputs) {
+        num_lines += input.end();
+    }
+    STATS.print(num_lines);
+}
+
+// Lines [start, end) of a file, numbered from 0, to check with --query.
+struct Change {
+    std::string path;
+    LineNo start;
+    LineNo end;
+};
+
+// Parses a decimal number.
+std::optional<std::size_t> parse_number(const std::string_view digits) {
+    if (digits.empty()) {
+        return std::nullopt;
+    }
+    std::size_t n = 0;
+    for (const char c : digits) {
+        if (c < '0' || c > '9') {
+            return std::nullopt;
+        }
+        n = n * 10 + static_cast<std::size_t>(c - '0');
+    }
+    return n;
+}
+
+// Parses PATH:LINE or PATH:START-END, with lines numbered from 1.
+std::optional<Change> parse_change(const std::string_view arg) {
+    const auto colon = arg.rfind(':');
+    if (colon == std::string_view::npos || colon == 0) {
+        return std::nullopt;
+    }
+    const auto numbers = arg.substr(colon + 1);
+    const auto dash = numbers.find('-');
+    const auto start = parse_number(numbers.substr(0, dash)).value_or(0);
+    const auto end =
+        dash == std::string_view::npos
+            ? start
+            : parse_number(numbers.substr(dash + 1)).value_or(0);
+    if (start == 0 || end < start) {
+        return std::nullopt;
+    }
+    return Change{index_path(arg.substr(0, colon)), start - 1, end};
+}
+
+// Parses a hunk header, @@ -OLD[,COUNT] +NEW[,COUNT] @@, where counts default
+// to 1, into {OLD, COUNT, NEW, COUNT}.
+std::optional<std::array<std::size_t, 4>> parse_hunk(
+    const std::string_view text) {
+    std::array<std::size_t, 4> values = {0, 1, 0, 1};
+    const char* p = text.data() + 3;
+    const char* const end = text.data() + text.size();
+    for (std::size_t side = 0; side < 2; ++side) {
+        if (p == end || *p++ != (side == 0 ? '-' : '+')) {
+            return std::nullopt;
+        }
+        auto result = std::from_chars(p, end, values[side * 2]);
+        if (result.ec != std::errc()) {
+            return std::nullopt;
+        }
+        p = result.ptr;
+        if (p != end && *p == ',') {
+            result = std::from_chars(p + 1, end, values[side * 2 + 1]);
+            if (result.ec != std::errc()) {
+                return std::nullopt;
+            }
+            p = result.ptr;
+        }
+        if (p == end || *p++ != ' ') {
+            return std::nullopt;
+        }
+    }
+    if (std::string_view(p, static_cast<std::size_t>(end - p))
+            .substr(0, 2) != "@@") {
+        return std::nullopt;
+    }
+    return values;
+}
+
+// Collects the lines added by a unified diff, numbered as in the new files.
+void parse_diff(Input& diff, std::vector<Change>& changes) {
+    std::string path;
+    LineNo line = 0;
+    std::size_t old_left = 0;
+    std::size_t new_left = 0;
+    std::string_view text;
+    while (diff.stream(text)) {
+        if (old_left == 0 && new_left == 0) {
+            if (text.substr(0, 4) == "+++ ") {
+                path = text.substr(4, text.find('\t') - 4);
+                if (path.substr(0, 2) == "b/") {
+                    path.erase(0, 2);
+                }
+                path = path == "/dev/null" ? "" : index_path(path);
+            } else if (text.substr(0, 3) == "@@ ") {
+                const auto values = parse_hunk(text);
+                if (!values) {
+                    fail("%s: line %zu: invalid hunk header", diff.name(),
+                         diff.end());
+                }
+                old_left = (*values)[1];
+                new_left = (*values)[3];
+                line = (*values)[2] == 0 ? 0 : (*values)[2] - 1;
+            }
+            continue;
+        }
+        const char kind = text.empty() ? ' ' : text[0];
+        if (kind == '+' || kind == ' ') {
+            if (kind == '+' && !path.empty()) {
+                if (!changes.empty() && changes.back().path == path &&
+                    changes.back().end == line) {
+                    ++changes.back().end;
+                } else {
+                    changes.push_back(Change{path, line, line + 1});
+                }
+            }
+            ++line;
+            new_left -= new_left != 0;
+        }
+        if (kind == '-' || kind == ' ') {
+            old_left -= old_left != 0;
+        }
+    }
+}
+
+// Marks the windows of min lines that overlap lines [start, end).
+void want_windows(std::vector<bool>& wanted, const LineNo start,
+                  const LineNo end, const std::size_t min) {
+    const auto first = start + 1 > min ? start + 1 - min : 0;
+    for (auto s = first; s < std::min(end, wanted.size()); ++s) {
+        wanted[s] = true;
+    }
+}
+
+// Reports duplicates of the changed lines found in an index, or elsewhere in
+// the same file. Only windows overlapping the changes are looked up. Lines of
+// other files are read only to verify a match, so files changed since the
+// index was built can only cause matches to be missed.
+void query_index(const std::vector<Change>& changes, const Options& options) {
+    const WindowIndex index(options.query);
+    const auto min = index.min();
+    const auto normalize = index.normalize();
+    std::deque<Input> files;
+    std::unordered_map<std::string, Input*> by_path;
+    const auto load = [&](const std::string& path) -> Input* {
+        const auto it = by_path.find(path);
+        if (it != by_path.end()) {
+            return it->second;
+        }
+        auto& input = files.emplace_back(path);
+        Input* result = nullptr;
+        if (input.exists() && !input.is_stream() && input.open()) {
+            input.read();
+            result = &input;
+        }
+        by_path.emplace(path, result);
+        return result;
+    };
+
+    const std::vector<Input> none;
+    Reporter reporter(none, options);
+    for (std::size_t i = 0; i < changes.size();) {
+        const auto& path = changes[i].path;
+        Input* const input = load(path);
+        if (input == nullptr) {
+            fail("%s: %s", path.c_str(), std::strerror(ENOENT));
+        }
+        const auto fps = fingerprint_input(*input, min, normalize);
+        // The file's own windows, since the index has its old lines.
+        std::unordered_map<Fingerprint, std::vector<LineNo>, FingerprintHash>
+            own;
+        for (LineNo start = 0; start < fps.size(); ++start) {
+            own[fps[start]].push_back(start);
+        }
+        std::vector<bool> wanted(fps.size());
+        for (; i < changes.size() && changes[i].path == path; ++i) {
+            want_windows(wanted, changes[i].start, changes[i].end, min);
+        }
+        report_matches(
+            reporter, *input, wanted, min, normalize,
+            [&](const LineNo s, const auto& match) {
+                const auto [first, last] = index.find(fps[s]);
+                for (auto w = first; w != last; ++w) {
+                    const auto& other_path = index.path(w->file);
+                    if (other_path == path) {
+                        continue;
+                    }
+                    if (const Input* const other = load(other_path)) {
+                        match(other, s, w->start);
+                    }
+                }
+                for (const auto t : own[fps[s]]) {
+                    match(input, s, t);
+                }
+            });
+    }
+}
+
+// =============================================================================
+//       Server
+// =============================================================================
+
+// Keeps every window of MIN lines of a set of files in memory, and answers
+// requests from clients of a Unix domain socket. Clients are served one at a
+// time, and one that is idle for TIMEOUT_SECONDS is disconnected so that it
+// cannot block the others. See --serve in the usage for the protocol.
+class Server {
+   public:
+    Server(ThreadPool& pool, const std::vector<Input>& inputs,
+           const Options& options)
+        : options_(options), min_(static_cast<std::size_t>(options.min)) {
+        files_.resize(inputs.size());
+        for (std::size_t i = 0; i < inputs.size(); ++i) {
+            pool.submit([this, &inputs, i] {
+                files_[i] = read_file(index_path(inputs[i].name()));
+            });
+        }
+        pool.wait();
+        for (std::size_t i = 0; i < files_.size(); ++i) {
+            if (files_[i].input == nullptr) {
+                fail("%s: %s", inputs[i].name(), std::strerror(errno));
+            }
+            by_path_[files_[i].input->name()] = i;
+            add_windows(static_cast<std::uint32_t>(i));
+        }
+    }
+
+    // Listens on the socket at path, replacing a stale socket there, forever.
+    [[noreturn]] void serve(const char* const path) {
+        signal(SIGPIPE, SIG_IGN);
+        struct sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (std::strlen(path) >= sizeof addr.sun_path) {
+            fail("%s: socket path too long", path);
+        }
+        std::strcpy(addr.sun_path, path);
+        const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        // Only remove a socket, so that a mistyped path does not delete a
+        // regular file; bind() fails instead.
+        struct stat st;
+        if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+            unlink(path);
+        }
+        if (fd == -1 ||
+            bind(fd, reinterpret_cast<struct sockaddr*>(&addr),
+                 sizeof addr) == -1 ||
+            listen(fd, 16) == -1) {
+            fail("%s: %s", path, std::strerror(errno));
+        }
+        while (true) {
+            const int client = accept(fd, nullptr, nullptr);
+            if (client == -1) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                fail("%s: %s", path, std::strerror(errno));
+            }
+            struct timeval timeout = {};
+            timeout.tv_sec = TIMEOUT_SECONDS;
+            setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                       sizeof timeout);
+            setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                       sizeof timeout);
+            handle(client);
+            ::close(client);
+        }
+    }
+
+    std::size_t num_lines() const {
+        std::size_t total = 0;
+        for (const auto& file : files_) {
+            total += file.input == nullptr ? 0 : file.input->end();
+        }
+        return total;
+    }
+
+   private:
+    // Seconds a client may wait between requests, or block a response.
+    static constexpr long TIMEOUT_SECONDS = 10;
+
+    struct File {
+        std::unique_ptr<Input> input;  // null if it could not be read
+        std::vector<Fingerprint> fps;
+    };
+
+    File read_file(const std::string& path) const {
+        File file;
+        auto input = std::make_unique<Input>(path);
+        if (!input->load()) {
+            return file;
+        }
+        input->read();
+        file.fps = fingerprint_input(*input, min_, options_.normalize);
+        file.input = std::move(input);
+        return file;
+    }
+
+    void add_windows(const std::uint32_t id) {
+        const auto& fps = files_[id].fps;
+        for (std::size_t start = 0; start < fps.size(); ++start) {
+            windows_[fps[start]].push_back(
+                Occurrence{id, static_cast<std::uint32_t>(start)});
+        }
+    }
+
+    void remove_windows(const std::uint32_t id) {
+        for (const auto& fp : files_[id].fps) {
+            const auto it = windows_.find(fp);
+            if (it == windows_.end()) {
+                continue;
+            }
+            auto& occs = it->second;
+            occs.erase(std::remove_if(occs.begin(), occs.end(),
+                                      [id](const Occurrence occ) {
+                                          return occ.input == id;
+                                      }),
+                       occs.end());
+            if (occs.empty()) {
+                windows_.erase(it);
+            }
+        }
+        files_[id].fps.clear();
+    }
+
+    // Rereads a file, or forgets it if it no longer exists. Returns an error
+    // message on failure.
+    std::string update(const std::string& path) {
+        auto file = read_file(path);
+        if (file.input == nullptr && errno != ENOENT) {
+            return std::strerror(errno);
+        }
+        const auto it = by_path_.find(path);
+        if (it != by_path_.end()) {
+            remove_windows(static_cast<std::uint32_t>(it->second));
+            files_[it->second] = {};
+            if (file.input == nullptr) {
+                by_path_.erase(it);
+                return {};
+            }
+        } else if (file.input != nullptr) {
+            by_path_[path] = files_.size();
+            files_.emplace_back();
+        } else {
+            return {};
+        }
+        const auto id = by_path_[path];
+        files_[id] = std::move(file);
+        add_windows(static_cast<std::uint32_t>(id));
+        return {};
+    }
+
+    // Reports duplicates of the wanted windows of input to the client.
+    void query(const int client, const Input& input,
+               const std::vector<Fingerprint>& fps,
+               const std::vector<bool>& wanted) const {
+        const std::vector<Input> none;
+        Reporter reporter(none, options_, client);
+        report_matches(reporter, input, wanted, min_, options_.normalize,
+                       [&](const LineNo s, const auto& match) {
+                           const auto it = windows_.find(fps[s]);
+                           if (it == windows_.end()) {
+                               return;
+                           }
+                           for (const auto occ : it->second) {
+                               match(files_[occ.input].input.get(), s,
+                                     occ.start);
+                           }
+                       });
+    }
+
+    void handle(const int client) {
+        Input requests("(client)");
+        requests.open_stream(dup(client), false);
+        std::string_view line;
+        while (requests.stream(line)) {
+            std::string error;
+            if (line.substr(0, 7) == "update ") {
+                error = update(index_path(line.substr(7)));
+            } else if (line.substr(0, 6) == "query ") {
+                const auto change = parse_change(line.substr(6));
+                const auto it = change ? by_path_.find(change->path)
+                                       : by_path_.end();
+                if (!change) {
+                    error = "invalid lines";
+                } else if (it == by_path_.end()) {
+                    error = "not indexed";
+                } else {
+                    const auto& file = files_[it->second];
+                    std::vector<bool> wanted(file.fps.size());
+                    want_windows(wanted, change->start, change->end, min_);
+                    query(client, *file.input, file.fps, wanted);
+                }
+            } else if (line.substr(0, 6) == "block ") {
+                const auto count = parse_number(line.substr(6));
+                std::string text;
+                for (std::size_t i = 0;
+                     count && i < *count && requests.stream(line); ++i) {
+                    text.append(line);
+                    text.push_back('\n');
+                }
+                if (!count) {
+                    error = "invalid count";
+                } else {
+                    Input block("(block)");
+                    block.assign(text);
+                    block.read();
+                    const auto fps =
+                        fingerprint_input(block, min_, options_.normalize);
+                    query(client, block, fps,
+                          std::vector<bool>(fps.size(), true));
+                }
+            } else {
+                error = "unknown request";
+            }
+            Writer out(client, false);
+            if (error.empty()) {
+                out.put("ok\n");
+            } else {
+                out.put("error: ");
+                out.put(error);
+                out.put('\n');
+            }
+        }
+    }
+
+    const Options& options_;
+    const std::size_t min_;
+    std::vector<File> files_;
+    std::unordered_map<std::string, std::size_t> by_path_;
+    std::unordered_map<Fingerprint, std::vector<Occurrence>, FingerprintHash>
+        windows_;
+};
+
+void serve(std::vector<Input>& inputs, const Options& options) {
+    if (options.stats) {
+        STATS.start();
+    }
+    ThreadPool pool(static_cast<unsigned>(options.jobs));
+    Walker walker(pool, [](Input&) {});
+    walker.start(options);
+    pool.wait();
+    walker.finish(inputs);
+    Server server(pool, inputs, options);
+    inputs.clear();
+    STATS.phase("ingest");
+    STATS.print(server.num_lines());
+    server.serve(options.serve);
+}
+
+// =============================================================================
+//       Suffix engine
 // =============================================================================
 
-const char* const USAGE = R"EOS(
-Usage: duplines [-h] [-m MIN] [-M MAX] FILE ...
+// Position in the concatenation of all inputs.
+using Pos = std::uint32_t;
 
-This script finds duplicate regions in text files.
+// Builds the suffix array of text by prefix doubling with counting sorts, in
+// O(n log n) time. Every symbol must be less than alphabet, and the last symbol
+// must be unique so that no suffix is a prefix of another.
+std::vector<Pos> suffix_array(const std::vector<LineId>& text,
+                              const std::size_t alphabet) {
+    const auto n = static_cast<Pos>(text.size());
+    std::vector<Pos> sa(n), tmp(n), rank(text.begin(), text.end()), next(n);
+    std::vector<Pos> count(std::max<std::size_t>(alphabet, n) + 1);
+    auto counting_sort = [&](const std::vector<Pos>& order, std::size_t k) {
+        std::fill(count.begin(), count.begin() + k + 1, 0);
+        for (Pos i = 0; i < n; ++i) {
+            ++count[rank[i] + 1];
+        }
+        for (std::size_t c = 1; c <= k; ++c) {
+            count[c] += count[c - 1];
+        }
+        for (const auto i : order) {
+            sa[count[rank[i]]++] = i;
+        }
+    };
+    for (Pos i = 0; i < n; ++i) {
+        tmp[i] = i;
+    }
+    counting_sort(tmp, alphabet);
+    std::size_t classes = alphabet;
+    for (Pos k = 1;; k *= 2) {
+        // Recompute ranks so that they compare the first k symbols.
+        auto second = [&](Pos i) {
+            return i + k / 2 < n ? rank[i + k / 2] : n;
+        };
+        next[sa[0]] = 0;
+        for (Pos i = 1; i < n; ++i) {
+            const auto a = sa[i - 1];
+            const auto b = sa[i];
+            const bool same = rank[a] == rank[b] &&
+                              (k == 1 || second(a) == second(b));
+            next[b] = next[a] + !same;
+        }
+        std::swap(rank, next);
+        classes = rank[sa[n - 1]] + 1;
+        if (classes == n) {
+            break;
+        }
+        // Sort by the second half first, then stable sort by the first half.
+        Pos p = 0;
+        for (Pos i = n - std::min(n, k); i < n; ++i) {
+            tmp[p++] = i;
+        }
+        for (Pos i = 0; i < n; ++i) {
+            if (sa[i] >= k) {
+                tmp[p++] = sa[i] - k;
+            }
+        }
+        counting_sort(tmp, classes);
+    }
+    return sa;
+}
 
-Flags:
-    -h  display this help messge
-    -m  minimum number of lines in region
-    -M  maximum number of lines in region
-)EOS";
+// Builds the longest common prefix array using Kasai's algorithm. The value at
+// index i is the LCP of the suffixes at sa[i - 1] and sa[i].
+std::vector<Pos> lcp_array(const std::vector<LineId>& text,
+                           const std::vector<Pos>& sa) {
+    const auto n = static_cast<Pos>(text.size());
+    std::vector<Pos> rank(n), lcp(n);
+    for (Pos i = 0; i < n; ++i) {
+        rank[sa[i]] = i;
+    }
+    Pos h = 0;
+    for (Pos i = 0; i < n; ++i) {
+        if (rank[i] == 0) {
+            h = 0;
+            continue;
+        }
+        const auto j = sa[rank[i] - 1];
+        while (i + h < n && j + h < n && text[i + h] == text[j + h]) {
+            ++h;
+        }
+        lcp[rank[i]] = h;
+        if (h > 0) {
+            --h;
+        }
+    }
+    return lcp;
+}
 
-struct Options {
-    int min = 0;
-    int max = 0;
-};
+void find_dups_suffix(ThreadPool& pool, std::vector<Input>& inputs,
+                      const Options& options) {
+    const auto min = static_cast<Pos>(options.min);
+    // Concatenate all inputs, ending each with a unique separator so that no
+    // repeat can cross a file boundary.
+    Interner interner(options.normalize);
+    std::vector<LineId> text;
+    std::vector<Pos> starts;
+    ingest(pool, inputs, interner, options);
+    STATS.phase("ingest");
+    for (const auto& input : inputs) {
+        starts.push_back(static_cast<Pos>(text.size()));
+        text.insert(text.end(), input.ids(), input.ids() + input.end());
+        text.push_back(0);
+    }
+    const auto num_ids = interner.size();
+    const auto alphabet = num_ids + inputs.size();
+    if (text.size() >= std::numeric_limits<Pos>::max() - 1 ||
+        alphabet >= std::numeric_limits<LineId>::max() - 1) {
+        fail("too many lines for suffix engine");
+    }
+    for (std::size_t i = 0; i < inputs.size(); ++i) {
+        const auto end = i + 1 < inputs.size() ? starts[i + 1] : text.size();
+        text[end - 1] = static_cast<LineId>(num_ids + i);
+    }
+    const auto sa = suffix_array(text, alphabet);
+    const auto lcp = lcp_array(text, sa);
+    const auto n = static_cast<Pos>(text.size());
 
-const char* PROGRAM = nullptr;
+    // Enumerate LCP intervals bottom-up. Each interval is a right-maximal
+    // repeat; keep those that are also left-maximal, i.e. not every occurrence
+    // is preceded by the same line.
+    constexpr LineId NONE = std::numeric_limits<LineId>::max();
+    constexpr LineId MIXED = NONE - 1;
+    struct Frame {
+        Pos lcp;
+        Pos lb;
+        Pos first;  // smallest position in the interval
+        LineId left;
+    };
+    struct Repeat {
+        Pos len;
+        Pos lb;
+        Pos rb;  // inclusive
+        Pos first;
+    };
+    auto merge = [](Frame& parent, const Frame& child) {
+        parent.first = std::min(parent.first, child.first);
+        if (parent.left == NONE) {
+            parent.left = child.left;
+        } else if (parent.left != child.left) {
+            parent.left = MIXED;
+        }
+    };
+    std::vector<Repeat> repeats;
+    std::vector<Frame> stack{{0, 0, NONE, NONE}};
+    for (Pos i = 1; i <= n; ++i) {
+        const auto h = i < n ? lcp[i] : 0;
+        const auto p = sa[i - 1];
+        const Frame leaf{0, i - 1, p, p == 0 ? MIXED : text[p - 1]};
+        merge(stack.back(), leaf);
+        std::optional<Frame> last;
+        while (h < stack.back().lcp) {
+            last = stack.back();
+            stack.pop_back();
+            if (last->lcp >= min && last->left == MIXED) {
+                repeats.push_back(
+                    Repeat{last->lcp, last->lb, i - 1, last->first});
+            }
+            if (h <= stack.back().lcp) {
+                merge(stack.back(), *last);
+            }
+        }
+        if (h > stack.back().lcp) {
+            Frame frame = last ? *last : leaf;
+            frame.lcp = h;
+            stack.push_back(frame);
+        }
+    }
+
+    // Report the largest duplicates first, breaking ties by position.
+    std::sort(repeats.begin(), repeats.end(),
+              [](const Repeat& a, const Repeat& b) {
+                  return a.len != b.len ? a.len > b.len : a.first < b.first;
+              });
+    STATS.phase("index");
+    Reporter reporter(inputs, options);
+    std::vector<Pos> positions;
+    std::vector<LineRange> ranges;
+    for (const auto& repeat : repeats) {
+        if (reporter.done()) {
+            break;
+        }
+        positions.assign(sa.begin() + repeat.lb, sa.begin() + repeat.rb + 1);
+        std::sort(positions.begin(), positions.end());
+        ranges.clear();
+        for (const auto pos : positions) {
+            const auto file = static_cast<std::size_t>(
+                std::upper_bound(starts.begin(), starts.end(), pos) -
+                starts.begin() - 1);
+            const auto start = pos - starts[file];
+            ranges.push_back(
+                LineRange{&inputs[file], start, start + repeat.len});
+        }
+        reporter.report(ranges);
+    }
+}
 
 // =============================================================================
-//       I/O helpers
+//       Seed-and-extend engine
 // =============================================================================
 
-class Input;
+// Grows a set of equal ranges one line at a time while all of them can be,
+// splitting it into subsets whenever their next lines differ. Adds every set
+// of two or more reached this way that is also left-maximal, meaning not
+// every range is preceded by the same line, to repeats. These are exactly the
+// repeats found from the suffix array that start with the given ranges.
+void extend_seeds(std::vector<LineRange> seeds,
+                  std::vector<std::vector<LineRange>>& repeats) {
+    constexpr LineId NONE = std::numeric_limits<LineId>::max();
+    // Ranges at the end of a file can never be extended, like the unique
+    // separators between files in the suffix engine.
+    const auto next = [](const LineRange& r) {
+        return r.end < r.input->end() ? r.input->ids()[r.end] : NONE;
+    };
+    std::vector<std::vector<LineRange>> stack;
+    stack.push_back(std::move(seeds));
+    while (!stack.empty()) {
+        auto set = std::move(stack.back());
+        stack.pop_back();
+        while (true) {
+            const auto line = next(set.front());
+            if (line == NONE ||
+                !std::all_of(set.begin() + 1, set.end(),
+                             [&](const LineRange& r) {
+                                 return next(r) == line;
+                             })) {
+                break;
+            }
+            for (auto& r : set) {
+                ++r.end;
+            }
+        }
+        const auto first = set.front();
+        const bool left_maximal = std::any_of(
+            set.begin(), set.end(), [&](const LineRange& r) {
+                return r.start == 0 || first.start == 0 ||
+                       r.input->ids()[r.start - 1] !=
+                           first.input->ids()[first.start - 1];
+            });
+        if (left_maximal) {
+            repeats.push_back(set);
+        }
+        // Split by the next line, keeping ranges in order of position.
+        std::stable_sort(set.begin(), set.end(),
+                         [&](const LineRange& a, const LineRange& b) {
+                             return next(a) < next(b);
+                         });
+        for (auto it = set.begin(); it != set.end();) {
+            const auto line = next(*it);
+            const auto end = std::find_if(it, set.end(),
+                                          [&](const LineRange& r) {
+                                              return next(r) != line;
+                                          });
+            if (line != NONE && end - it >= 2) {
+                std::vector<LineRange> subset(it, end);
+                for (auto& r : subset) {
+                    ++r.end;
+                }
+                stack.push_back(std::move(subset));
+            }
+            it = end;
+        }
+    }
+}
 
-// Zero-based line number.
-using LineNo = std::size_t;
+// Like find_dups_suffix, but only indexes windows of MIN lines as seeds. Each
+// set of equal seeds is then extended by comparing the following lines, so
+// the index grows with the number of lines rather than lines times lengths.
+// Extension is slower than a suffix array for very repetitive inputs, since a
+// long run of equal lines is split one range at a time.
+void find_dups_seed(ThreadPool& pool, std::vector<Input>& inputs,
+                    const Options& options) {
+    const auto min = static_cast<std::size_t>(options.min);
+    Interner interner(options.normalize);
+    ingest(pool, inputs, interner, options);
+    STATS.phase("ingest");
+    ShardedIndex index;
+    for (std::size_t i = 0; i < inputs.size(); ++i) {
+        const auto& input = inputs[i];
+        const auto id = static_cast<std::uint32_t>(i);
+        for_each_chunk(input.end(), [&](LineNo first, LineNo last) {
+            pool.submit([&, id, first, last] {
+                hash_windows_of(interner, input, id, first, last, min, index);
+            });
+        });
+    }
+    pool.wait();
+    const auto seeds = index.merge(pool, inputs);
+    STATS.phase("index");
 
-struct LineRange {
-    const Input* input;
-    LineNo start;  // inclusive
-    LineNo end;    // exclusive
-};
+    constexpr std::size_t BATCH = 1024;
+    std::vector<std::vector<std::vector<LineRange>>> found(
+        (seeds.size() + BATCH - 1) / BATCH);
+    for (std::size_t b = 0; b < found.size(); ++b) {
+        pool.submit([&, b] {
+            const auto end = std::min(seeds.size(), (b + 1) * BATCH);
+            for (auto i = b * BATCH; i < end; ++i) {
+                extend_seeds(*seeds[i], found[b]);
+            }
+        });
+    }
+    pool.wait();
+    std::vector<std::vector<LineRange>> repeats;
+    for (auto& batch : found) {
+        std::move(batch.begin(), batch.end(), std::back_inserter(repeats));
+        batch = {};
+    }
+    // Report the largest duplicates first, breaking ties by position.
+    std::sort(repeats.begin(), repeats.end(),
+              [](const std::vector<LineRange>& a,
+                 const std::vector<LineRange>& b) {
+                  const auto a_len = a.front().end - a.front().start;
+                  const auto b_len = b.front().end - b.front().start;
+                  if (a_len != b_len) {
+                      return a_len > b_len;
+                  }
+                  return a.front().input != b.front().input
+                             ? a.front().input < b.front().input
+                             : a.front().start < b.front().start;
+              });
+    STATS.phase("extend");
+    Reporter reporter(inputs, options);
+    for (const auto& ranges : repeats) {
+        if (reporter.done()) {
+            break;
+        }
+        reporter.report(ranges);
+    }
+}
 
-class Input {
-   public:
-    explicit Input(const char* const filename)
-        : filename_(filename), file_(filename) {}
+// =============================================================================
+//       Near-duplicate engine
+// =============================================================================
 
-    const char* name() const { return filename_; }
+// Each window of MIN lines is summarized by a MinHash signature over its
+// shingles (pairs of adjacent line IDs), split into bands. Windows sharing a
+// band are candidates, and are confirmed by a bounded line edit distance. Two
+// windows whose shingle sets have Jaccard similarity s share a band with
+// probability 1 - (1 - s^NEAR_ROWS)^NEAR_BANDS: about 0.98 for s = 0.8 and
+// 0.67 for s = 0.6.
+constexpr int NEAR_BANDS = 8;
+constexpr int NEAR_ROWS = 4;
+constexpr int NEAR_HASHES = NEAR_BANDS * NEAR_ROWS;
 
-    bool exists() const { return std::filesystem::is_regular_file(filename_); }
+// Buckets with more windows than this are skipped, since they come from
+// boilerplate repeated so often that comparing all pairs would be quadratic.
+constexpr std::size_t NEAR_MAX_BUCKET = 64;
 
-    bool getline() { return bool(std::getline(file_, lines_.emplace_back())); }
+// Widest band used to compute the edit distance of a merged region. Beyond
+// it, the reported distance is a lower bound.
+constexpr std::size_t NEAR_MAX_BAND = 4096;
 
-    std::string_view get(const LineNo lineno) const { return lines_[lineno]; }
+std::uint64_t mix64(std::uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+// Sliding-window minimum over a stream of values, as a monotone queue in a
+// ring buffer.
+class MinQueue {
+   public:
+    explicit MinQueue(const std::size_t capacity) {
+        std::size_t size = 1;
+        while (size < capacity) {
+            size *= 2;
+        }
+        values_.resize(size);
+        positions_.resize(size);
+        mask_ = size - 1;
+    }
+
+    void push(const std::uint64_t value, const LineNo pos) {
+        while (size_ != 0 && values_[index(size_ - 1)] >= value) {
+            --size_;
+        }
+        values_[index(size_)] = value;
+        positions_[index(size_)] = pos;
+        ++size_;
+    }
 
-    LineNo end() const { return lines_.size(); }
+    // Drops values pushed before pos.
+    void expire(const LineNo pos) {
+        while (size_ != 0 && positions_[head_] < pos) {
+            head_ = (head_ + 1) & mask_;
+            --size_;
+        }
+    }
+
+    std::uint64_t min() const { return values_[head_]; }
 
    private:
-    const char* filename_;
-    std::ifstream file_;
-    std::vector<std::string> lines_;
-};
+    std::size_t index(const std::size_t i) const {
+        return (head_ + i) & mask_;
+    }
 
-using Hash = std::size_t;
+    std::vector<std::uint64_t> values_;
+    std::vector<LineNo> positions_;
+    std::size_t mask_;
+    std::size_t head_ = 0;
+    std::size_t size_ = 0;
+};
 
-class Hasher {
-   public:
-    Hash get() const { return h_; }
+struct BandEntry {
+    std::uint64_t key;
+    Occurrence occ;
+};
 
-    template <typename T>
-    void combine(const T& value) {
-        // http://stackoverflow.com/a/1646913
-        h_ = h_ * 31 + std::hash<T>()(value);
+// Computes band keys for the windows of `width` lines starting in [first,
+// last), calling f(key, start) for each band whose key differs from the
+// previous window's. Consecutive windows usually share most bands, so this
+// keeps the index small; confirmation searches nearby alignments to make up
+// for it.
+template <typename F>
+void near_windows(const Interner& interner, const Input& input,
+                  const std::size_t width, const LineNo first,
+                  const LineNo last, F f) {
+    // Each hash function is a multiply by an odd constant after xoring with a
+    // seed, which permutes the already well-mixed shingle hashes.
+    static const auto seeds = [] {
+        std::array<std::uint64_t, 2 * NEAR_HASHES> seeds;
+        for (int j = 0; j < 2 * NEAR_HASHES; ++j) {
+            seeds[j] = mix64(0x9e3779b97f4a7c15ull * (j + 1)) | (j & 1);
+        }
+        return seeds;
+    }();
+    const auto* ids = input.ids();
+    const auto shingles = width - 1;
+    // Shingles are pushed before old ones expire, so allow one extra.
+    std::vector<MinQueue> queues(NEAR_HASHES, MinQueue(shingles + 1));
+    std::array<std::uint64_t, NEAR_BANDS> keys{};
+    for (auto i = first; i < last + shingles - 1; ++i) {
+        const auto shingle =
+            mix64(interner.hash(ids[i]) * 31 + interner.hash(ids[i + 1]));
+        for (int j = 0; j < NEAR_HASHES; ++j) {
+            queues[j].push((shingle ^ seeds[2 * j]) * seeds[2 * j + 1], i);
+        }
+        if (i + 1 < first + shingles) {
+            continue;
+        }
+        const auto start = i + 1 - shingles;
+        for (int b = 0; b < NEAR_BANDS; ++b) {
+            std::uint64_t key = static_cast<std::uint64_t>(b);
+            for (int r = 0; r < NEAR_ROWS; ++r) {
+                auto& queue = queues[b * NEAR_ROWS + r];
+                queue.expire(start);
+                key = mix64(key ^ queue.min());
+            }
+            if (start == first || key != keys[b]) {
+                f(key, start);
+            }
+            keys[b] = key;
+        }
     }
+}
 
-   private:
-    Hash h_ = 17;
+// Where a copy of a window was found, after alignment.
+struct NearMatch {
+    Occurrence a;
+    LineNo a_end;
+    Occurrence b;
+    LineNo b_end;
 };
 
-// =============================================================================
-//       Find duplicates
-// =============================================================================
+// Aligns a (entirely) against any substring of b, returning the smallest
+// line edit distance with the matched substring, or nullopt if it exceeds
+// bound.
+std::optional<std::pair<std::size_t, std::pair<LineNo, LineNo>>> fit(
+    const LineId* const a, const std::size_t n, const LineId* const b,
+    const std::size_t m, const std::size_t bound) {
+    // Each cell holds the cost and the column in b where its alignment
+    // starts. Row 0 is free, so the match may start anywhere.
+    struct Cell {
+        std::size_t cost;
+        std::size_t start;
+    };
+    std::vector<Cell> prev(m + 1);
+    std::vector<Cell> cur(m + 1);
+    for (std::size_t j = 0; j <= m; ++j) {
+        prev[j] = Cell{0, j};
+    }
+    for (std::size_t i = 1; i <= n; ++i) {
+        cur[0] = Cell{i, 0};
+        auto best = cur[0].cost;
+        for (std::size_t j = 1; j <= m; ++j) {
+            auto cell = prev[j - 1];
+            cell.cost += a[i - 1] != b[j - 1];
+            if (prev[j].cost + 1 < cell.cost) {
+                cell = Cell{prev[j].cost + 1, prev[j].start};
+            }
+            if (cur[j - 1].cost + 1 < cell.cost) {
+                cell = Cell{cur[j - 1].cost + 1, cur[j - 1].start};
+            }
+            cur[j] = cell;
+            best = std::min(best, cell.cost);
+        }
+        if (best > bound) {
+            return std::nullopt;
+        }
+        std::swap(prev, cur);
+    }
+    std::size_t end = 0;
+    for (std::size_t j = 1; j <= m; ++j) {
+        if (prev[j].cost < prev[end].cost) {
+            end = j;
+        }
+    }
+    if (prev[end].cost > bound) {
+        return std::nullopt;
+    }
+    return std::make_pair(prev[end].cost, std::make_pair(prev[end].start, end));
+}
 
-void find_dups(std::vector<Input>& inputs, const Options& options) {
-    const auto min = static_cast<std::size_t>(options.min);
-    const auto max = static_cast<std::size_t>(options.max);
-    const auto num_lens = max - min + 1;
-    std::vector<std::unordered_map<Hash, std::vector<LineRange>>> map(num_lens);
-    std::set<std::pair<std::size_t, Hash>> hits;
-    for (auto& input : inputs) {
-        while (input.getline()) {
-            Hasher hasher;
-            const auto end = input.end();
-            LineNo len = 1;
-            for (; len < std::min(min, end); ++len) {
-                const auto start = end - len;
-                hasher.combine(input.get(start));
+// Returns the line edit distance between a and b, computing only cells
+// within bound of the diagonal. Returns bound + 1 if it exceeds bound.
+std::size_t bounded_edits(const LineId* const a, const std::size_t n,
+                          const LineId* const b, const std::size_t m,
+                          const std::size_t bound) {
+    const auto over = bound + 1;
+    if ((n > m ? n - m : m - n) > bound) {
+        return over;
+    }
+    std::vector<std::size_t> prev(m + 1, over);
+    std::vector<std::size_t> cur(m + 1, over);
+    for (std::size_t j = 0; j <= std::min(m, bound); ++j) {
+        prev[j] = j;
+    }
+    for (std::size_t i = 1; i <= n; ++i) {
+        const auto lo = i > bound ? i - bound : 0;
+        const auto hi = std::min(m, i + bound);
+        std::fill(cur.begin() + (lo > 0 ? lo - 1 : 0),
+                  cur.begin() + std::min(m, hi + 1) + 1, over);
+        if (lo == 0) {
+            cur[0] = i;
+        }
+        for (auto j = std::max<std::size_t>(lo, 1); j <= hi; ++j) {
+            cur[j] = std::min({prev[j - 1] + (a[i - 1] != b[j - 1]),
+                               prev[j] + 1, cur[j - 1] + 1, over});
+        }
+        std::swap(prev, cur);
+    }
+    return std::min(prev[m], over);
+}
+
+// Drops lines at the edges of a pair of regions that do not line up, by
+// deleting from one side or substituting, at most max_edits times per edge.
+// Windows that straddle the boundary of a similar region pick these up.
+void trim(const LineId* const a, std::uint32_t& a_start, LineNo& a_end,
+          const LineId* const b, std::uint32_t& b_start, LineNo& b_end,
+          const std::size_t max_edits) {
+    for (std::size_t k = 0; k < max_edits; ++k) {
+        if (a_end - a_start < 2 || b_end - b_start < 2 ||
+            a[a_start] == b[b_start]) {
+            break;
+        }
+        const bool skip_a = a[a_start + 1] == b[b_start];
+        const bool skip_b = a[a_start] == b[b_start + 1];
+        a_start += !skip_b;
+        b_start += !skip_a;
+    }
+    for (std::size_t k = 0; k < max_edits; ++k) {
+        if (a_end - a_start < 2 || b_end - b_start < 2 ||
+            a[a_end - 1] == b[b_end - 1]) {
+            break;
+        }
+        const bool skip_a = a[a_end - 2] == b[b_end - 1];
+        const bool skip_b = a[a_end - 1] == b[b_end - 2];
+        a_end -= !skip_b;
+        b_end -= !skip_a;
+    }
+}
+
+// Finds regions of at least MIN lines that are within max_edits line edits of
+// each other per MIN lines, without comparing all pairs of windows.
+void find_dups_near(ThreadPool& pool, std::vector<Input>& inputs,
+                    const Options& options) {
+    const auto width = static_cast<std::size_t>(options.min);
+    const auto max_edits = static_cast<std::size_t>(options.max_edits);
+    Interner interner(options.normalize);
+    ingest(pool, inputs, interner, options);
+    STATS.phase("ingest");
+
+    // Index band keys by shard.
+    constexpr std::size_t NUM_SHARDS = 64;
+    struct Shard {
+        std::mutex mutex;
+        std::vector<BandEntry> entries;
+    };
+    std::vector<Shard> shards(NUM_SHARDS);
+    for (std::size_t i = 0; i < inputs.size(); ++i) {
+        const auto& input = inputs[i];
+        if (input.end() < width) {
+            continue;
+        }
+        const auto id = static_cast<std::uint32_t>(i);
+        const auto num_windows = input.end() - width + 1;
+        for_each_chunk(num_windows, [&, id](LineNo first, LineNo last) {
+            pool.submit([&, id, first, last] {
+                std::vector<std::vector<BandEntry>> local(NUM_SHARDS);
+                const auto add = [&](std::uint64_t key, LineNo start) {
+                    const Occurrence occ{id, static_cast<std::uint32_t>(start)};
+                    local[key % NUM_SHARDS].push_back(BandEntry{key, occ});
+                };
+                near_windows(interner, input, width, first, last, add);
+                for (std::size_t s = 0; s < NUM_SHARDS; ++s) {
+                    std::lock_guard<std::mutex> lock(shards[s].mutex);
+                    auto& entries = shards[s].entries;
+                    entries.insert(entries.end(), local[s].begin(),
+                                   local[s].end());
+                }
+            });
+        });
+    }
+    pool.wait();
+
+    // Collect candidate pairs from each bucket, ordered by position.
+    const auto before = [](const Occurrence& x, const Occurrence& y) {
+        return x.input != y.input ? x.input < y.input : x.start < y.start;
+    };
+    std::vector<std::pair<Occurrence, Occurrence>> candidates;
+    std::mutex mutex;
+    for (auto& shard : shards) {
+        pool.submit([&] {
+            auto& entries = shard.entries;
+            std::sort(entries.begin(), entries.end(),
+                      [&](const BandEntry& x, const BandEntry& y) {
+                          return x.key != y.key ? x.key < y.key
+                                                : before(x.occ, y.occ);
+                      });
+            std::vector<std::pair<Occurrence, Occurrence>> local;
+            for (std::size_t i = 0, j; i < entries.size(); i = j) {
+                for (j = i + 1;
+                     j < entries.size() && entries[j].key == entries[i].key;
+                     ++j) {
+                }
+                if (j - i > NEAR_MAX_BUCKET) {
+                    continue;
+                }
+                for (auto x = i; x < j; ++x) {
+                    for (auto y = x + 1; y < j; ++y) {
+                        local.emplace_back(entries[x].occ, entries[y].occ);
+                    }
+                }
             }
-            for (; len >= min && len <= std::min(max, end); ++len) {
-                const auto start = end - len;
-                hasher.combine(input.get(start));
-                const auto encoded_len = len - min;
-                assert(encoded_len < num_lens);
-                const auto hash = hasher.get();
-                auto& slot = map[encoded_len][hash];
-                slot.push_back(LineRange{&input, start, end});
-                if (slot.size() > 1) {
-                    hits.emplace(encoded_len, hash);
+            entries = std::vector<BandEntry>();
+            std::lock_guard<std::mutex> lock(mutex);
+            candidates.insert(candidates.end(), local.begin(), local.end());
+        });
+    }
+    pool.wait();
+    const auto pair_less = [&](const auto& x, const auto& y) {
+        return before(x.first, y.first) ||
+               (!before(y.first, x.first) && before(x.second, y.second));
+    };
+    std::sort(candidates.begin(), candidates.end(), pair_less);
+    candidates.erase(
+        std::unique(candidates.begin(), candidates.end(),
+                    [&](const auto& x, const auto& y) {
+                        return !pair_less(x, y) && !pair_less(y, x);
+                    }),
+        candidates.end());
+
+    // Confirm candidates by aligning the first window anywhere near the
+    // second, since its band key may have been recorded up to a window away.
+    std::vector<NearMatch> matches;
+    const auto num_candidates = static_cast<LineNo>(candidates.size());
+    for_each_chunk(num_candidates, [&](LineNo first, LineNo last) {
+        pool.submit([&, first, last] {
+            std::vector<NearMatch> local;
+            for (auto c = first; c < last; ++c) {
+                const auto [x, y] = candidates[c];
+                const auto& a = inputs[x.input];
+                const auto& b = inputs[y.input];
+                const auto lo = y.start > width ? y.start - width : 0;
+                const auto hi = std::min(b.end(), y.start + 2 * width);
+                const auto result = fit(a.ids() + x.start, width,
+                                        b.ids() + lo, hi - lo, max_edits);
+                if (!result) {
+                    continue;
                 }
+                const auto b_start = lo + result->second.first;
+                const auto b_end = lo + result->second.second;
+                if (x.input == y.input && b_start < x.start + width) {
+                    continue;
+                }
+                local.push_back(NearMatch{
+                    x, x.start + width,
+                    Occurrence{y.input, static_cast<std::uint32_t>(b_start)},
+                    b_end});
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            matches.insert(matches.end(), local.begin(), local.end());
+        });
+    });
+    pool.wait();
+
+    // Merge matches along about the same alignment into maximal regions.
+    // Windows are only indexed where a band key changes, so consecutive
+    // matches may be up to a window apart.
+    std::sort(matches.begin(), matches.end(),
+              [&](const NearMatch& x, const NearMatch& y) {
+                  if (x.a.input != y.a.input) {
+                      return x.a.input < y.a.input;
+                  }
+                  if (x.b.input != y.b.input) {
+                      return x.b.input < y.b.input;
+                  }
+                  return x.a.start != y.a.start ? x.a.start < y.a.start
+                                                : x.b.start < y.b.start;
+              });
+    struct Region {
+        NearMatch match;
+        std::size_t edits;
+    };
+    std::vector<Region> regions;
+    std::vector<Region> open;
+    const auto close = [&](const std::size_t k) {
+        regions.push_back(open[k]);
+        open[k] = open.back();
+        open.pop_back();
+    };
+    // Whether a match continues a region along about the same alignment.
+    // When they do not overlap, the lines around the gap must be similar too.
+    const auto continues = [&](const NearMatch& r, const NearMatch& m) {
+        const auto diagonal = [](std::size_t a, std::size_t b) {
+            return static_cast<std::int64_t>(b) - static_cast<std::int64_t>(a);
+        };
+        const auto shift = std::min(
+            std::abs(diagonal(r.a.start, r.b.start) -
+                     diagonal(m.a.start, m.b.start)),
+            std::abs(diagonal(r.a_end, r.b_end) - diagonal(m.a_end, m.b_end)));
+        if (shift > static_cast<std::int64_t>(max_edits) ||
+            m.b.start > r.b_end + width || r.b.start > m.b_end) {
+            return false;
+        }
+        if (m.a.start <= r.a_end && m.b.start <= r.b_end) {
+            return true;
+        }
+        const auto a_first = std::max<std::size_t>(r.a.start, r.a_end - width);
+        const auto b_first = std::max<std::size_t>(r.b.start, r.b_end - width);
+        const auto n = m.a_end - a_first;
+        const auto edits = bounded_edits(
+            inputs[r.a.input].ids() + a_first, n,
+            inputs[r.b.input].ids() + b_first, m.b_end - b_first,
+            max_edits * (n / width + 1));
+        return edits * width <= max_edits * n;
+    };
+    for (const auto& match : matches) {
+        bool merged = false;
+        for (std::size_t k = 0; k < open.size();) {
+            auto& r = open[k].match;
+            if (r.a.input != match.a.input || r.b.input != match.b.input ||
+                r.a_end + width < match.a.start) {
+                close(k);
+                continue;
+            }
+            if (!merged && continues(r, match)) {
+                r.a_end = std::max(r.a_end, match.a_end);
+                r.b.start = std::min(r.b.start, match.b.start);
+                r.b_end = std::max(r.b_end, match.b_end);
+                merged = true;
             }
+            ++k;
+        }
+        if (!merged) {
+            open.push_back(Region{match, 0});
         }
     }
-    std::unordered_map<const Input*, std::vector<bool>> taken;
-    for (const auto& input : inputs) {
-        const auto num_lines = input.end();
-        taken.emplace(&input, num_lines);
-    }
-    // Iterate in reverse order to get the largest duplicates first, and skip
-    // over any smaller duplicates contained within them.
-    for (auto it = hits.crbegin(); it != hits.crend(); ++it) {
-        const auto encoded_len = it->first;
-        const auto hash = it->second;
-        const auto& slot = map[encoded_len][hash];
-        const auto first_range = slot.front();
-        for (const auto range : slot) {
-            auto& bitmap = taken[range.input];
-            for (auto i = range.start; i < range.end; ++i) {
-                if (bitmap[i]) {
-                    // Very conservative: never report another duplicate in
-                    // which even one line of one copy has already been reported
-                    // as part of another set of duplicates.
-                    goto skip;
-                }
-                bitmap[i] = true;
+    while (!open.empty()) {
+        close(open.size() - 1);
+    }
+    const auto num_regions = static_cast<LineNo>(regions.size());
+    for_each_chunk(num_regions, [&](LineNo first, LineNo last) {
+        pool.submit([&, first, last] {
+            for (auto k = first; k < last; ++k) {
+                auto& region = regions[k];
+                auto& m = region.match;
+                const auto* a = inputs[m.a.input].ids();
+                const auto* b = inputs[m.b.input].ids();
+                trim(a, m.a.start, m.a_end, b, m.b.start, m.b_end, max_edits);
+                const auto n = m.a_end - m.a.start;
+                const auto len_b = m.b_end - m.b.start;
+                // Edits are spread out, since every window had at most
+                // max_edits, so a band this wide is exact in practice.
+                const auto band = std::min<std::size_t>(
+                    NEAR_MAX_BAND, (max_edits + 1) * (n / width + 1) +
+                                       (n > len_b ? n - len_b : len_b - n));
+                region.edits = bounded_edits(a + m.a.start, n, b + m.b.start,
+                                             len_b, band);
             }
+        });
+    });
+    pool.wait();
+
+    // Drop regions that became too short, or that are too different overall,
+    // which can happen when merging across a gap.
+    regions.erase(
+        std::remove_if(regions.begin(), regions.end(),
+                       [&](const Region& region) {
+                           const auto n =
+                               region.match.a_end - region.match.a.start;
+                           return n < width ||
+                                  region.edits * width > max_edits * n;
+                       }),
+        regions.end());
+
+    // Report the largest regions first, breaking ties by position.
+    std::sort(regions.begin(), regions.end(),
+              [&](const Region& x, const Region& y) {
+                  const auto xn = x.match.a_end - x.match.a.start;
+                  const auto yn = y.match.a_end - y.match.a.start;
+                  if (xn != yn) {
+                      return xn > yn;
+                  }
+                  if (before(x.match.a, y.match.a)) {
+                      return true;
+                  }
+                  return !before(y.match.a, x.match.a) &&
+                         before(x.match.b, y.match.b);
+              });
+    // Group the regions into sets, so that each region is reported once. A
+    // pair with one copy overlapping a set already formed adds the other copy
+    // to that set, and a pair with both copies covered adds nothing.
+    struct Set {
+        std::vector<LineRange> ranges;
+        std::size_t edits;
+    };
+    std::vector<Set> sets;
+    constexpr auto NONE = std::numeric_limits<std::size_t>::max();
+    // Ranges in sets by input, keyed by start, which never overlap.
+    std::vector<std::map<LineNo, std::pair<LineNo, std::size_t>>> owners(
+        inputs.size());
+    const auto owner = [&](const LineRange range,
+                           const std::uint32_t input) -> std::size_t {
+        const auto& ranges = owners[input];
+        auto it = ranges.lower_bound(range.end);
+        if (it == ranges.begin()) {
+            return NONE;
         }
-        for (const auto range : slot) {
-            std::printf("%s:%zu\n", range.input->name(), range.start + 1);
+        --it;
+        return it->second.first > range.start ? it->second.second : NONE;
+    };
+    const auto add = [&](const std::size_t set, const LineRange range,
+                         const std::uint32_t input) {
+        sets[set].ranges.push_back(range);
+        owners[input].emplace(range.start, std::make_pair(range.end, set));
+    };
+    for (const auto& region : regions) {
+        const auto& m = region.match;
+        const LineRange a{&inputs[m.a.input], m.a.start, m.a_end};
+        const LineRange b{&inputs[m.b.input], m.b.start, m.b_end};
+        if (m.a.input == m.b.input && a.start < b.end && b.start < a.end) {
+            continue;
         }
-        std::printf("\n");
-        for (auto i = first_range.start; i < first_range.end; ++i) {
-            const auto line = first_range.input->get(i);
-            std::printf("> %.*s\n", static_cast<int>(line.size()), line.data());
+        const auto a_set = owner(a, m.a.input);
+        const auto b_set = owner(b, m.b.input);
+        if (a_set != NONE && b_set != NONE) {
+            continue;
+        }
+        if (a_set != NONE || b_set != NONE) {
+            const auto set = a_set != NONE ? a_set : b_set;
+            sets[set].edits = std::max(sets[set].edits, region.edits);
+            if (a_set == NONE) {
+                add(set, a, m.a.input);
+            } else {
+                add(set, b, m.b.input);
+            }
+            continue;
+        }
+        sets.push_back(Set{{}, region.edits});
+        add(sets.size() - 1, a, m.a.input);
+        add(sets.size() - 1, b, m.b.input);
+    }
+    STATS.phase("index");
+    Reporter reporter(inputs, options);
+    for (const auto& set : sets) {
+        if (reporter.done()) {
+            break;
+        }
+        reporter.report_near(set.ranges, set.edits);
+    }
+}
+
+void find_dups(std::vector<Input>& inputs, const Options& options) {
+    if (options.stats) {
+        STATS.start();
+    }
+    ThreadPool pool(static_cast<unsigned>(options.jobs));
+    switch (options.engine) {
+    case Engine::Hash:
+        if (options.stream) {
+            find_dups_stream(inputs, options);
+        } else if (options.memory_limit != 0) {
+            find_dups_external(pool, inputs, options);
+        } else {
+            find_dups_hash(pool, inputs, options);
         }
-        std::printf("\n\n");
-    skip:;
+        break;
+    case Engine::Sort:
+        find_dups_sort(pool, inputs, options);
+        break;
+    case Engine::Suffix:
+        find_dups_suffix(pool, inputs, options);
+        break;
+    case Engine::Seed:
+        find_dups_seed(pool, inputs, options);
+        break;
+    case Engine::Near:
+        find_dups_near(pool, inputs, options);
+        break;
+    }
+    STATS.phase("report");
+    std::size_t num_lines = 0;
+    for (const auto& input : inputs) {
+        num_lines += input.end();
     }
+    STATS.print(num_lines);
 }
 
 }  // namespace
@@ -168,22 +5817,135 @@ int main(int argc, char** argv) {
     PROGRAM = argv[0];
 
     Options options;
-    std::vector<Input> inputs;
+    bool recursive = false;
+    std::vector<const char*> paths;
     for (int i = 1; i < argc; ++i) {
         if (std::strcmp(argv[i], "-h") == 0) {
             std::fputs(USAGE, stdout);
             return 0;
         }
+        if (std::strncmp(argv[i], "--engine=", 9) == 0) {
+            const char* const engine = argv[i] + 9;
+            if (std::strcmp(engine, "hash") == 0) {
+                options.engine = Engine::Hash;
+            } else if (std::strcmp(engine, "sort") == 0) {
+                options.engine = Engine::Sort;
+            } else if (std::strcmp(engine, "suffix") == 0) {
+                options.engine = Engine::Suffix;
+            } else if (std::strcmp(engine, "seed") == 0) {
+                options.engine = Engine::Seed;
+            } else if (std::strcmp(engine, "near") == 0) {
+                options.engine = Engine::Near;
+            } else {
+                std::fprintf(stderr, "%s: %s: invalid engine\n", PROGRAM,
+                             engine);
+                return 1;
+            }
+            continue;
+        }
+        if (std::strncmp(argv[i], "--memory-limit=", 15) == 0) {
+            const auto size = parse_size(argv[i] + 15);
+            if (!size || *size == 0) {
+                std::fprintf(stderr, "%s: %s: invalid size\n", PROGRAM,
+                             argv[i] + 15);
+                return 1;
+            }
+            options.memory_limit = *size;
+            continue;
+        }
+        if (std::strncmp(argv[i], "--cache=", 8) == 0) {
+            options.cache = argv[i] + 8;
+            continue;
+        }
+        if (std::strncmp(argv[i], "--build-index=", 14) == 0) {
+            options.build_index = argv[i] + 14;
+            continue;
+        }
+        if (std::strncmp(argv[i], "--rev=", 6) == 0) {
+            options.revs.push_back(argv[i] + 6);
+            continue;
+        }
+        if (std::strncmp(argv[i], "--serve=", 8) == 0) {
+            options.serve = argv[i] + 8;
+            continue;
+        }
+        if (std::strncmp(argv[i], "--query=", 8) == 0) {
+            options.query = argv[i] + 8;
+            continue;
+        }
+        if (std::strncmp(argv[i], "--exclude=", 10) == 0) {
+            options.excludes.push_back(argv[i] + 10);
+            continue;
+        }
+        if (std::strcmp(argv[i], "-r") == 0) {
+            recursive = true;
+            continue;
+        }
+        if (std::strncmp(argv[i], "--max-edits=", 12) == 0) {
+            try {
+                options.max_edits = std::stoi(argv[i] + 12);
+            } catch (const std::logic_error&) {
+                options.max_edits = -1;
+            }
+            if (options.max_edits < 0) {
+                std::fprintf(stderr, "%s: %s: invalid number\n", PROGRAM,
+                             argv[i] + 12);
+                return 1;
+            }
+            continue;
+        }
+        if (std::strncmp(argv[i], "--format=", 9) == 0) {
+            const char* const format = argv[i] + 9;
+            if (std::strcmp(format, "text") == 0) {
+                options.format = Format::Text;
+            } else if (std::strcmp(format, "jsonl") == 0) {
+                options.format = Format::Jsonl;
+            } else {
+                std::fprintf(stderr, "%s: %s: invalid format\n", PROGRAM,
+                             format);
+                return 1;
+            }
+            continue;
+        }
+        if (std::strcmp(argv[i], "--stats") == 0) {
+            options.stats = true;
+            continue;
+        }
+        if (std::strcmp(argv[i], "--progressive") == 0) {
+            options.progressive = true;
+            continue;
+        }
+        if (std::strcmp(argv[i], "-n") == 0) {
+            options.snippet = false;
+            continue;
+        }
+        if (std::strcmp(argv[i], "-l") == 0) {
+            options.normalize |= NORM_LEADING;
+            continue;
+        }
+        if (std::strcmp(argv[i], "-b") == 0) {
+            options.normalize |= NORM_SPACE;
+            continue;
+        }
+        if (std::strcmp(argv[i], "-i") == 0) {
+            options.normalize |= NORM_CASE;
+            continue;
+        }
         const bool a = std::strcmp(argv[i], "-m") == 0;
         const bool b = std::strcmp(argv[i], "-M") == 0;
-        if (a || b) {
+        const bool j = std::strcmp(argv[i], "-j") == 0;
+        const bool k = std::strcmp(argv[i], "-k") == 0;
+        if (a || b || j || k) {
             if (i + 1 == argc) {
                 std::fprintf(stderr, "%s: %s: must provide an argument\n",
                              PROGRAM, argv[i]);
                 return 1;
             }
             ++i;
-            int* value = a ? &options.min : &options.max;
+            int* value = a   ? &options.min
+                         : b ? &options.max
+                         : j ? &options.jobs
+                             : &options.top;
             try {
                 *value = std::stoi(argv[i]);
             } catch (const std::logic_error&) {
@@ -191,33 +5953,152 @@ int main(int argc, char** argv) {
                              argv[i]);
                 return 1;
             }
-            if (*value <= 1) {
-                std::fprintf(stderr, "%s: %s: must be > 1\n", PROGRAM, argv[i]);
+            if (j || k ? *value < 1 : *value <= 1) {
+                std::fprintf(stderr, "%s: %s: must be > %d\n", PROGRAM,
+                             argv[i], j || k ? 0 : 1);
                 return 1;
             }
         } else {
-            inputs.emplace_back(argv[i]);
+            paths.push_back(argv[i]);
+        }
+    }
+    if (options.jobs == 0) {
+        options.jobs = static_cast<int>(
+            std::max(1u, std::thread::hardware_concurrency()));
+    }
+    if (options.query != nullptr) {
+        // MIN and the normalization flags come from the index.
+        std::vector<Change> changes;
+        for (const char* const path : paths) {
+            if (auto change = parse_change(path)) {
+                changes.push_back(std::move(*change));
+                continue;
+            }
+            Input diff(path);
+            if (!diff.exists() || !diff.open_stream()) {
+                std::fprintf(stderr, "%s: %s: %s\n", PROGRAM, path,
+                             std::strerror(diff.exists() ? errno : ENOENT));
+                return 1;
+            }
+            parse_diff(diff, changes);
         }
+        if (paths.empty()) {
+            Input diff("-");
+            diff.open_stream();
+            parse_diff(diff, changes);
+        }
+        query_index(changes, options);
+        return 0;
     }
     if (options.min == 0) {
         std::fprintf(stderr, "%s: missing required flag -m", PROGRAM);
         return 1;
     }
-    if (options.max == 0) {
-        std::fprintf(stderr, "%s: missing required flag -M", PROGRAM);
+    if (options.build_index != nullptr || options.serve != nullptr) {
+        if (options.engine != Engine::Hash || options.memory_limit != 0 ||
+            (options.build_index != nullptr && options.serve != nullptr)) {
+            std::fprintf(stderr,
+                         "%s: --build-index and --serve require the hash "
+                         "engine, and cannot be used together or with "
+                         "--memory-limit\n",
+                         PROGRAM);
+            return 1;
+        }
+    } else if (options.engine == Engine::Hash ||
+               options.engine == Engine::Sort) {
+        if (options.max == 0) {
+            std::fprintf(stderr, "%s: missing required flag -M", PROGRAM);
+            return 1;
+        }
+        if (options.min > options.max) {
+            std::fprintf(stderr, "%s: min must be less than max", PROGRAM);
+            return 1;
+        }
+    }
+    if (options.engine != Engine::Hash && options.memory_limit != 0) {
+        std::fprintf(stderr, "%s: --memory-limit requires the hash engine\n",
+                     PROGRAM);
+        return 1;
+    }
+    if (options.engine == Engine::Near && options.max_edits >= options.min) {
+        std::fprintf(stderr, "%s: max edits must be less than min\n", PROGRAM);
+        return 1;
+    }
+    if (options.progressive &&
+        (options.engine != Engine::Hash || options.top != 0 ||
+         options.memory_limit != 0 || options.build_index != nullptr ||
+         options.serve != nullptr)) {
+        std::fprintf(stderr,
+                     "%s: --progressive requires the hash engine, and cannot "
+                     "be used with -k, --memory-limit, --build-index, or "
+                     "--serve\n",
+                     PROGRAM);
         return 1;
     }
-    if (options.min > options.max) {
-        std::fprintf(stderr, "%s: min must be less than max", PROGRAM);
+    if (options.memory_limit != 0 && options.cache != nullptr) {
+        std::fprintf(stderr, "%s: --cache cannot be used with --memory-limit\n",
+                     PROGRAM);
         return 1;
     }
+    std::vector<Input> inputs;
+    if (!options.revs.empty()) {
+        if (recursive || options.memory_limit != 0 ||
+            options.cache != nullptr || options.build_index != nullptr ||
+            options.serve != nullptr) {
+            std::fprintf(stderr,
+                         "%s: --rev cannot be used with -r, --memory-limit, "
+                         "--cache, --build-index, or --serve\n",
+                         PROGRAM);
+            return 1;
+        }
+        add_revisions(options.revs, paths, inputs);
+        find_dups(inputs, options);
+        return 0;
+    }
+    for (const char* const path : paths) {
+        if (recursive && std::filesystem::is_directory(path)) {
+            options.dirs.push_back(path);
+        } else {
+            inputs.emplace_back(path);
+        }
+    }
     for (const auto& input : inputs) {
+        options.stream = options.stream || input.is_stream();
+    }
+    if (options.stream &&
+        (options.engine != Engine::Hash || recursive || options.top != 0 ||
+         options.cache != nullptr || options.progressive ||
+         options.build_index != nullptr || options.serve != nullptr)) {
+        std::fprintf(stderr,
+                     "%s: reading from a stream requires the hash engine, "
+                     "and cannot be used with -r, -k, --cache, "
+                     "--progressive, --build-index, or --serve\n",
+                     PROGRAM);
+        return 1;
+    }
+    for (auto& input : inputs) {
+        if (std::filesystem::is_directory(input.name())) {
+            std::fprintf(stderr, "%s: %s: is a directory (use -r)\n",
+                         PROGRAM, input.name());
+            return 1;
+        }
         if (!input.exists()) {
             std::fprintf(stderr, "%s: %s: file not found\n", PROGRAM,
                          input.name());
             return 1;
         }
+        if (!(options.stream ? input.open_stream() : input.open())) {
+            std::fprintf(stderr, "%s: %s: %s\n", PROGRAM, input.name(),
+                         std::strerror(errno));
+            return 1;
+        }
+    }
+    if (options.build_index != nullptr) {
+        build_index(inputs, options);
+    } else if (options.serve != nullptr) {
+        serve(inputs, options);
+    } else {
+        find_dups(inputs, options);
     }
-    find_dups(inputs, options);
     return 0;
 }
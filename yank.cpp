@@ -1,10 +1,19 @@
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <iostream>
+#include <limits>
 #include <memory>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 extern "C" {
+#include <sys/uio.h>
 #include <unistd.h>
 }
 
@@ -33,6 +42,10 @@ The second option disables tmux clipboard support. If it is set to "external",
 tmux will intercept the OSC 52 sequence and attempt to set the clipboard itself
 (which won't work if you're in a remote ssh session). If set to "on", it will
 additionally set the tmux buffer. Both of these are made redundant by yank.
+
+Base64 encoding uses the widest vector instructions the CPU supports. To use a
+particular encoder instead, for example to compare their output, set
+$YANK_ENCODER to scalar, ssse3, avx2, or avx512vbmi.
 )EOS";
 
 constexpr char base64_table[65] =
@@ -71,22 +84,251 @@ void base64_encode(char* const dest, const char* const source,
     }
 }
 
+#if defined(__x86_64__) || defined(__i386__)
+
+// The vector encoders below follow Wojciech Muła and Daniel Lemire, "Faster
+// Base64 Encoding and Decoding Using AVX2 Instructions" (2018). Each handles
+// whole groups of input while enough bytes remain for its loads, then leaves
+// the rest to base64_encode.
+
+// Splits each 3-byte group, shuffled into a 32-bit lane as bytes 1, 0, 2, 1,
+// into four 6-bit indices, one per byte.
+__attribute__((target("ssse3"))) __m128i base64_indices(const __m128i in) {
+    const auto t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    const auto t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    const auto t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    const auto t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    return _mm_or_si128(t1, t3);
+}
+
+// Maps 6-bit indices to base64 characters by adding an offset that depends
+// on which of the five ranges of the alphabet each falls in.
+__attribute__((target("ssse3"))) __m128i base64_chars(const __m128i indices) {
+    auto range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    const auto upper = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+    range = _mm_or_si128(range, _mm_and_si128(upper, _mm_set1_epi8(13)));
+    const auto offsets = _mm_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    return _mm_add_epi8(_mm_shuffle_epi8(offsets, range), indices);
+}
+
+// Encodes 12 bytes at a time, loading 16.
+__attribute__((target("ssse3"))) void base64_encode_ssse3(
+    char* dest, const char* source, std::size_t len) {
+    const auto order =
+        _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    for (; len >= 16; source += 12, dest += 16, len -= 12) {
+        auto in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source));
+        in = _mm_shuffle_epi8(in, order);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest),
+                         base64_chars(base64_indices(in)));
+    }
+    base64_encode(dest, source, len);
+}
+
+// Like base64_encode_ssse3, but encodes 24 bytes at a time, 12 per lane,
+// loading 28.
+__attribute__((target("avx2"))) void base64_encode_avx2(char* dest,
+                                                        const char* source,
+                                                        std::size_t len) {
+    const auto order = _mm256_setr_epi8(
+        1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10, 1, 0, 2, 1, 4, 3, 5,
+        4, 7, 6, 8, 7, 10, 9, 11, 10);
+    const auto t0_mask = _mm256_set1_epi32(0x0fc0fc00);
+    const auto t1_mul = _mm256_set1_epi32(0x04000040);
+    const auto t2_mask = _mm256_set1_epi32(0x003f03f0);
+    const auto t3_mul = _mm256_set1_epi32(0x01000010);
+    const auto offsets = _mm256_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    for (; len >= 28; source += 24, dest += 32, len -= 24) {
+        auto in = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(source))),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + 12)), 1);
+        in = _mm256_shuffle_epi8(in, order);
+        const auto t1 = _mm256_mulhi_epu16(_mm256_and_si256(in, t0_mask),
+                                           t1_mul);
+        const auto t3 = _mm256_mullo_epi16(_mm256_and_si256(in, t2_mask),
+                                           t3_mul);
+        const auto indices = _mm256_or_si256(t1, t3);
+        auto range = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+        const auto upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices);
+        range = _mm256_or_si256(
+            range, _mm256_and_si256(upper, _mm256_set1_epi8(13)));
+        const auto chars =
+            _mm256_add_epi8(_mm256_shuffle_epi8(offsets, range), indices);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest), chars);
+    }
+    base64_encode_ssse3(dest, source, len);
+}
+
+// Encodes 48 bytes at a time, loading 64. VBMI can extract each 6-bit field
+// with one multishift and look up all 64 characters with one permute.
+__attribute__((target("avx512f,avx512bw,avx512vbmi"))) void
+base64_encode_avx512vbmi(char* dest, const char* source, std::size_t len) {
+    const auto order = _mm512_setr_epi32(
+        0x01020001, 0x04050304, 0x07080607, 0x0a0b090a, 0x0d0e0c0d,
+        0x10110f10, 0x13141213, 0x16171516, 0x191a1819, 0x1c1d1b1c,
+        0x1f201e1f, 0x22232122, 0x25262425, 0x28292728, 0x2b2c2a2b,
+        0x2e2f2d2e);
+    const auto shifts = _mm512_set1_epi64(0x3036242a1016040a);
+    const auto table = _mm512_loadu_si512(base64_table);
+    // The zero-masking forms with every lane selected are the same as the
+    // plain ones, which GCC 12 warns about from its own headers.
+    const __mmask64 all = ~__mmask64{0};
+    for (; len >= 64; source += 48, dest += 64, len -= 48) {
+        auto in = _mm512_loadu_si512(source);
+        in = _mm512_maskz_permutexvar_epi8(all, order, in);
+        const auto indices =
+            _mm512_maskz_multishift_epi64_epi8(all, shifts, in);
+        _mm512_storeu_si512(dest,
+                            _mm512_maskz_permutexvar_epi8(all, indices, table));
+    }
+    base64_encode_avx2(dest, source, len);
+}
+
+#endif
+
+using Encoder = void (*)(char*, const char*, std::size_t);
+
+// Returns the fastest encoder the CPU supports, or the one named by
+// $YANK_ENCODER, so that their output can be compared.
+Encoder select_encoder() {
+    const char* const name = std::getenv("YANK_ENCODER");
+    const auto wants = [&](const char* const encoder) {
+        return name == nullptr || std::strcmp(name, encoder) == 0;
+    };
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (wants("avx512vbmi") && __builtin_cpu_supports("avx512vbmi") &&
+        __builtin_cpu_supports("avx512bw")) {
+        return base64_encode_avx512vbmi;
+    }
+    if (wants("avx2") && __builtin_cpu_supports("avx2")) {
+        return base64_encode_avx2;
+    }
+    if (wants("ssse3") && __builtin_cpu_supports("ssse3")) {
+        return base64_encode_ssse3;
+    }
+#endif
+    if (!wants("scalar")) {
+        std::fprintf(stderr, "ERROR: unsupported encoder: %s\n", name);
+        std::exit(1);
+    }
+    return base64_encode;
+}
+
 constexpr std::size_t NON_TMUX_ESCAPE_SIZE =
     std::char_traits<char>::length("\x1b]52;c;\a");
 
+// Input bytes encoded at a time. This is a multiple of 3 so that only the last
+// block needs padding.
+constexpr std::size_t BLOCK_SIZE = 3 << 14;
+
 const char* prefix = "";
 const char* suffix = "";
 
-void print_osc_52(const char* const base64, const std::size_t len) {
-    std::printf("%s\x1b]52;c;%.*s\a%s", prefix, static_cast<int>(len), base64,
-                suffix);
+// Reads from stdin until buf is full or the input ends, and returns the number
+// of bytes read.
+std::size_t read_block(char* const buf, const std::size_t size) {
+    std::size_t len = 0;
+    while (len < size) {
+        const auto n = read(STDIN_FILENO, buf + len, size - len);
+        if (n == 0) {
+            break;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::fprintf(stderr, "ERROR: read: %s\n", std::strerror(errno));
+            std::exit(1);
+        }
+        len += static_cast<std::size_t>(n);
+    }
+    return len;
+}
+
+// Writes the buffers to stdout, retrying after partial writes.
+void write_all(struct iovec* iov, int count) {
+    while (count > 0) {
+        const auto n = writev(STDOUT_FILENO, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::fprintf(stderr, "ERROR: write: %s\n", std::strerror(errno));
+            std::exit(1);
+        }
+        auto written = static_cast<std::size_t>(n);
+        for (; count > 0 && written >= iov->iov_len; ++iov, --count) {
+            written -= iov->iov_len;
+        }
+        if (count > 0) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+// Encodes stdin a block at a time and writes it as one OSC 52 sequence, so
+// that memory use is constant and output starts before the input ends. Reads
+// at most limit bytes. Returns without writing anything if the input is empty
+// and nonempty is set. Also copies the input to tmux_pipe if given, until
+// writing to it fails.
+void stream_osc_52(const std::size_t limit, const bool nonempty,
+                   FILE* tmux_pipe) {
+    static char buf[BLOCK_SIZE];
+    static char b64_buf[base64_enc_size(BLOCK_SIZE)];
+    const auto encode = select_encoder();
+    std::size_t total = 0;
+    bool started = false;
+    while (true) {
+        const auto want = std::min(BLOCK_SIZE, limit - total);
+        const auto len = read_block(buf, want);
+        total += len;
+        const bool last = len < want || total == limit;
+        if (!started && last && len == 0 && nonempty) {
+            return;
+        }
+        if (tmux_pipe != nullptr && len != 0) {
+            const auto n = std::fwrite(buf, 1, len, tmux_pipe);
+            if (n != len) {
+                std::fprintf(stderr, "ERROR: %zu, want %zu\n", n, len);
+                tmux_pipe = nullptr;
+            }
+        }
+        encode(b64_buf, buf, len);
+        struct iovec iov[5];
+        int count = 0;
+        const auto add = [&](const char* const data, const std::size_t size) {
+            iov[count++] = {const_cast<char*>(data), size};
+        };
+        if (!started) {
+            add(prefix, std::strlen(prefix));
+            add("\x1b]52;c;", 7);
+            started = true;
+        }
+        add(b64_buf, base64_enc_size(len));
+        if (last) {
+            add("\a", 1);
+            add(suffix, std::strlen(suffix));
+        }
+        write_all(iov, count);
+        if (last) {
+            return;
+        }
+    }
 }
 
 }  // namespace
 
 int main(int argc, char** argv) {
     (void)argv;
-    std::ios::sync_with_stdio(false);
     bool truncate = false;
     bool nonempty = false;
     for (int i = 1; i < argc; i++) {
@@ -121,48 +363,13 @@ int main(int argc, char** argv) {
         suffix = "\x1b\\";
         // Run `tmux load-buffer -` in writable mode.
         tmux_pipe.reset(popen("tmux load-buffer -", "w"));
+        // If tmux fails, still finish the escape sequence rather than leave
+        // the terminal in the middle of it.
+        std::signal(SIGPIPE, SIG_IGN);
     }
-    char* buf = nullptr;
-    std::size_t len = 0;
-    std::size_t cap;
-    if (truncate) {
-        cap = base64_dec_size(8192 - (tmux ? 0 : NON_TMUX_ESCAPE_SIZE));
-        buf = static_cast<char*>(std::malloc(cap));
-        std::cin.read(buf, cap);
-        len = static_cast<std::size_t>(std::cin.gcount());
-    } else {
-        const auto chunk_size = 16384;
-        cap = chunk_size;
-        buf = static_cast<char*>(std::malloc(cap));
-        while (std::cin.good()) {
-            if (len + chunk_size > cap) {
-                while (len + chunk_size > cap) {
-                    cap *= 2;
-                }
-                buf = static_cast<char*>(std::realloc(buf, cap));
-            }
-            std::cin.read(buf + len, chunk_size);
-            const auto additional = static_cast<std::size_t>(std::cin.gcount());
-            if (additional == 0) {
-                break;
-            }
-            len += additional;
-        }
-    }
-    if (nonempty && len == 0) {
-        return 0;
-    }
-    const auto b64_len = base64_enc_size(len);
-    char* b64_buf = static_cast<char*>(std::malloc(b64_len));
-    base64_encode(b64_buf, buf, len);
-    if (tmux) {
-        const auto n = std::fwrite(buf, 1, len, tmux_pipe.get());
-        if (n != len) {
-            std::fprintf(stderr, "ERROR: %zu, want %zu\n", n, len);
-        }
-    }
-    print_osc_52(b64_buf, b64_len);
-    std::free(buf);
-    std::free(b64_buf);
+    const auto limit =
+        truncate ? base64_dec_size(8192 - (tmux ? 0 : NON_TMUX_ESCAPE_SIZE))
+                 : std::numeric_limits<std::size_t>::max();
+    stream_osc_52(limit, nonempty, tmux_pipe.get());
     return 0;
 }